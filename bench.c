@@ -0,0 +1,851 @@
+// Throughput benchmark for the queue backends.
+// Compare the cache-line padded layout against the packed one by building both variants:
+//   gcc -O2 -std=c11 -pthread bench.c -o bench && ./bench
+//   gcc -O2 -std=c11 -pthread -DQUEUE_PACKED_LAYOUT bench.c -o bench_packed && ./bench_packed
+// and the condition variable parking against the futex one, counting the context switches each costs per operation:
+//   gcc -O2 -std=c11 -pthread -DQUEUE_FUTEX_PARKING bench.c -o bench_futex && ./bench_futex
+// and first-touch placement against per-node element pools and lanes on a multi-socket machine, with threads pinned to their sockets:
+//   gcc -O2 -std=c11 -pthread -DQUEUE_NUMA_PLACEMENT bench.c -o bench_numa && ./bench_numa matrix sharded
+// Sweep producer and consumer counts, batch sizes and producer rates and report throughput with enqueue-to-dequeue latency percentiles:
+//   ./bench matrix [list|ring|lock-free-list|sharded ...]
+// Drain a backlog of large, scattered payloads with and without prefetch_next and report what the prefetches gain:
+//   ./bench payload
+// Run every backend confined to 1, 2, 4 ... up to all available cores, with a producer and a consumer per core, checking that no item is lost or duplicated;
+// record throughput, context switches and cache misses per operation as JSON, and fail when throughput falls further than a threshold below a baseline
+// that an earlier run of the same build wrote. Counters come from perf_event_open() where the system allows it; cache misses are null where it does not.
+//   ./bench scale [--rounds 3] [--max-cores N] [--output bench-scale.json] [--baseline baseline.json] [--threshold 10]
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "queue.c"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#define COUNT_WITH_PERF_EVENTS
+#define PIN_TO_CORES
+#endif
+
+#define BENCH_ITEMS_PER_PRODUCER 200000
+#define BENCH_PRODUCERS 2
+#define BENCH_CONSUMERS 2
+#define BENCH_POLLERS 2
+
+// Build variant, as reported alongside the results
+#ifdef QUEUE_PACKED_LAYOUT
+#define BENCH_LAYOUT "packed"
+#else
+#define BENCH_LAYOUT "padded"
+#endif
+#ifdef PARK_ON_FUTEX
+#define BENCH_PARKING "futex"
+#else
+#define BENCH_PARKING "condvar"
+#endif
+
+struct BenchRun
+{
+    struct Queue *queue;
+    atomic_bool stop_polling;
+};
+
+int bench_producer(void *arg)
+{
+    struct BenchRun *run = (struct BenchRun *)arg;
+    for (long i = 1; i <= BENCH_ITEMS_PER_PRODUCER; i++)
+    {
+        queueEnqueue(run->queue, (void *)i);
+    }
+    return 0;
+}
+
+int bench_consumer(void *arg)
+{
+    struct BenchRun *run = (struct BenchRun *)arg;
+    long items_per_consumer = (long)BENCH_ITEMS_PER_PRODUCER * BENCH_PRODUCERS / BENCH_CONSUMERS;
+    for (long i = 0; i < items_per_consumer; i++)
+    {
+        queueDequeue(run->queue);
+    }
+    return 0;
+}
+
+// Monitoring threads that keep reading the counters, as a health checker would
+int bench_poller(void *arg)
+{
+    struct BenchRun *run = (struct BenchRun *)arg;
+    size_t observed = 0;
+    while (!atomic_load(&run->stop_polling))
+    {
+        observed += queueSize(run->queue) + queueVisited(run->queue) + queueWaiting(run->queue);
+    }
+    return (int)(observed & 1);
+}
+
+// Voluntary and involuntary context switches of the whole process so far
+long context_switches(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+double elapsed_seconds(const struct timespec *start, const struct timespec *end)
+{
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void bench_backend(const char *name, const struct QueueOptions *options)
+{
+    struct BenchRun run = {.queue = queueCreate(options)};
+    atomic_init(&run.stop_polling, false);
+    thrd_t producers[BENCH_PRODUCERS];
+    thrd_t consumers[BENCH_CONSUMERS];
+    thrd_t pollers[BENCH_POLLERS];
+    struct timespec start;
+    struct timespec end;
+
+    for (int i = 0; i < BENCH_POLLERS; i++)
+    {
+        thrd_create(&pollers[i], bench_poller, &run);
+    }
+    long switches = context_switches();
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < BENCH_CONSUMERS; i++)
+    {
+        thrd_create(&consumers[i], bench_consumer, &run);
+    }
+    for (int i = 0; i < BENCH_PRODUCERS; i++)
+    {
+        thrd_create(&producers[i], bench_producer, &run);
+    }
+    for (int i = 0; i < BENCH_PRODUCERS; i++)
+    {
+        thrd_join(producers[i], NULL);
+    }
+    for (int i = 0; i < BENCH_CONSUMERS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+    }
+    timespec_get(&end, TIME_UTC);
+    switches = context_switches() - switches;
+    atomic_store(&run.stop_polling, true);
+    for (int i = 0; i < BENCH_POLLERS; i++)
+    {
+        thrd_join(pollers[i], NULL);
+    }
+
+    double seconds = elapsed_seconds(&start, &end);
+    double operations = 2.0 * BENCH_ITEMS_PER_PRODUCER * BENCH_PRODUCERS;
+    printf("%-16s %-7s %-7s producers=%d consumers=%d pollers=%d %12.0f ops/sec %8.4f switches/op\n", name, BENCH_LAYOUT, BENCH_PARKING,
+           BENCH_PRODUCERS, BENCH_CONSUMERS, BENCH_POLLERS, operations / seconds, switches / operations);
+
+    queueDestroy(run.queue);
+}
+
+#define MATRIX_ITEMS_PER_PRODUCER 40000
+#define MATRIX_MAX_THREADS 4
+#define MATRIX_MAX_BATCH 32
+
+struct MatrixBackend
+{
+    const char *name;
+    enum QueueBackend backend;
+    // Most producers and consumers the backend supports; 0 puts no limit on them.
+    int max_producers;
+    int max_consumers;
+};
+
+static const struct MatrixBackend matrix_backends[] = {
+    {.name = "list", .backend = QUEUE_BACKEND_LIST},
+    {.name = "ring", .backend = QUEUE_BACKEND_RING},
+    {.name = "lock-free-list", .backend = QUEUE_BACKEND_LOCK_FREE_LIST},
+    {.name = "sharded", .backend = QUEUE_BACKEND_SHARDED},
+    {.name = "spsc-ring", .backend = QUEUE_BACKEND_SPSC_RING, .max_producers = 1, .max_consumers = 1},
+    {.name = "mpsc-list", .backend = QUEUE_BACKEND_MPSC_LIST, .max_consumers = 1},
+};
+static const int matrix_thread_counts[] = {1, 2, 4};
+static const size_t matrix_batch_sizes[] = {1, MATRIX_MAX_BATCH};
+// Items per second each producer offers; 0 produces as fast as the queue accepts.
+static const long matrix_rates[] = {0, 100000};
+
+// One cell of the matrix, shared by its producers and consumers
+struct MatrixRun
+{
+    struct Queue *queue;
+    int producers;
+    int consumers;
+    size_t batch;
+    long rate;
+    struct timespec start;
+    // Enqueue time of every item, indexed by item number, and the latency measured when it was dequeued
+    uint64_t *enqueued_at;
+    uint64_t *latencies;
+};
+
+struct MatrixProducer
+{
+    struct MatrixRun *run;
+    size_t first_item;
+};
+
+uint64_t nanoseconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000u + (uint64_t)now.tv_nsec - (uint64_t)start->tv_nsec;
+}
+
+int matrix_producer(void *arg)
+{
+    struct MatrixProducer *producer = (struct MatrixProducer *)arg;
+    struct MatrixRun *run = producer->run;
+    void *items[MATRIX_MAX_BATCH];
+    for (size_t sent = 0; sent < MATRIX_ITEMS_PER_PRODUCER; sent += run->batch)
+    {
+        // A paced producer offers each batch no earlier than its slot in the schedule
+        while (run->rate > 0 && nanoseconds_since(&run->start) < (uint64_t)(sent * 1000000000.0 / run->rate))
+        {
+            thrd_yield();
+        }
+        size_t count = MATRIX_ITEMS_PER_PRODUCER - sent < run->batch ? MATRIX_ITEMS_PER_PRODUCER - sent : run->batch;
+        uint64_t now = nanoseconds_since(&run->start);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t item = producer->first_item + sent + i;
+            run->enqueued_at[item] = now;
+            // Item numbers are offset by one so that no item is mistaken for NULL
+            items[i] = (void *)(uintptr_t)(item + 1);
+        }
+        if (count == 1)
+        {
+            queueEnqueue(run->queue, items[0]);
+        }
+        else
+        {
+            queueEnqueueBatch(run->queue, items, count);
+        }
+    }
+    return 0;
+}
+
+int matrix_consumer(void *arg)
+{
+    struct MatrixRun *run = (struct MatrixRun *)arg;
+    void *items[MATRIX_MAX_BATCH];
+    size_t remaining = (size_t)MATRIX_ITEMS_PER_PRODUCER * run->producers / run->consumers;
+    while (remaining > 0)
+    {
+        size_t wanted = remaining < run->batch ? remaining : run->batch;
+        size_t count = wanted == 1 ? (items[0] = queueDequeue(run->queue), 1) : queueDequeueBatch(run->queue, items, wanted);
+        uint64_t now = nanoseconds_since(&run->start);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t item = (uintptr_t)items[i] - 1;
+            run->latencies[item] = now - run->enqueued_at[item];
+        }
+        remaining -= count;
+    }
+    return 0;
+}
+
+int compare_latencies(const void *left, const void *right)
+{
+    uint64_t a = *(const uint64_t *)left;
+    uint64_t b = *(const uint64_t *)right;
+    return a < b ? -1 : a > b;
+}
+
+double latency_percentile(const uint64_t *sorted, size_t count, double percentile)
+{
+    return sorted[(size_t)(percentile / 100.0 * (double)(count - 1))] / 1000.0;
+}
+
+void bench_matrix_cell(const struct MatrixBackend *backend, struct MatrixRun *run)
+{
+    run->queue = queueCreate(&(struct QueueOptions){.backend = backend->backend});
+    size_t total = (size_t)MATRIX_ITEMS_PER_PRODUCER * run->producers;
+    thrd_t producers[MATRIX_MAX_THREADS];
+    thrd_t consumers[MATRIX_MAX_THREADS];
+    struct MatrixProducer producer_args[MATRIX_MAX_THREADS];
+
+    timespec_get(&run->start, TIME_UTC);
+    for (int i = 0; i < run->consumers; i++)
+    {
+        thrd_create(&consumers[i], matrix_consumer, run);
+    }
+    for (int i = 0; i < run->producers; i++)
+    {
+        producer_args[i] = (struct MatrixProducer){.run = run, .first_item = (size_t)i * MATRIX_ITEMS_PER_PRODUCER};
+        thrd_create(&producers[i], matrix_producer, &producer_args[i]);
+    }
+    for (int i = 0; i < run->producers; i++)
+    {
+        thrd_join(producers[i], NULL);
+    }
+    for (int i = 0; i < run->consumers; i++)
+    {
+        thrd_join(consumers[i], NULL);
+    }
+    double seconds = nanoseconds_since(&run->start) / 1e9;
+    queueDestroy(run->queue);
+
+    qsort(run->latencies, total, sizeof(uint64_t), compare_latencies);
+    printf("%-16s %9d %9d %5zu %9ld %12.0f %10.1f %10.1f %10.1f\n", backend->name, run->producers, run->consumers, run->batch, run->rate,
+           2.0 * total / seconds, latency_percentile(run->latencies, total, 50), latency_percentile(run->latencies, total, 99),
+           latency_percentile(run->latencies, total, 99.9));
+}
+
+void bench_matrix(const struct MatrixBackend *backend)
+{
+    struct MatrixRun run = {
+        .enqueued_at = malloc(sizeof(uint64_t) * MATRIX_ITEMS_PER_PRODUCER * MATRIX_MAX_THREADS),
+        .latencies = malloc(sizeof(uint64_t) * MATRIX_ITEMS_PER_PRODUCER * MATRIX_MAX_THREADS),
+    };
+    for (size_t r = 0; r < sizeof(matrix_rates) / sizeof(matrix_rates[0]); r++)
+    {
+        for (size_t b = 0; b < sizeof(matrix_batch_sizes) / sizeof(matrix_batch_sizes[0]); b++)
+        {
+            for (size_t p = 0; p < sizeof(matrix_thread_counts) / sizeof(matrix_thread_counts[0]); p++)
+            {
+                for (size_t c = 0; c < sizeof(matrix_thread_counts) / sizeof(matrix_thread_counts[0]); c++)
+                {
+                    run.producers = matrix_thread_counts[p];
+                    run.consumers = matrix_thread_counts[c];
+                    // Single-producer and single-consumer backends skip the cells they cannot serve
+                    if ((backend->max_producers > 0 && run.producers > backend->max_producers) ||
+                        (backend->max_consumers > 0 && run.consumers > backend->max_consumers))
+                    {
+                        continue;
+                    }
+                    run.batch = matrix_batch_sizes[b];
+                    run.rate = matrix_rates[r];
+                    bench_matrix_cell(backend, &run);
+                }
+            }
+        }
+    }
+    free(run.enqueued_at);
+    free(run.latencies);
+}
+
+int run_matrix(int argc, char **argv)
+{
+    size_t backend_count = sizeof(matrix_backends) / sizeof(matrix_backends[0]);
+    printf("%-16s %9s %9s %5s %9s %12s %10s %10s %10s\n", "backend", "producers", "consumers", "batch", "rate/s", "ops/sec", "p50 us", "p99 us",
+           "p99.9 us");
+    for (size_t i = 0; i < backend_count; i++)
+    {
+        // Without names every backend runs; otherwise only the named ones
+        bool selected = argc == 0;
+        for (int j = 0; j < argc; j++)
+        {
+            selected = selected || strcmp(argv[j], matrix_backends[i].name) == 0;
+        }
+        if (selected)
+        {
+            bench_matrix(&matrix_backends[i]);
+        }
+    }
+    return 0;
+}
+
+// Bytes of payload queued up in each run, well beyond any last-level cache
+#define PAYLOAD_BYTES (64u << 20)
+#define PAYLOAD_MAX_CONSUMERS 2
+
+static const size_t payload_sizes[] = {256, 1024, 4096};
+
+// A backlog of items, each pointing at a payload that its consumer reads in full
+struct PayloadRun
+{
+    struct Queue *queue;
+    size_t payload_size;
+    size_t items_per_consumer;
+    atomic_ulong checksum;
+};
+
+int payload_consumer(void *arg)
+{
+    struct PayloadRun *run = (struct PayloadRun *)arg;
+    unsigned long checksum = 0;
+    for (size_t i = 0; i < run->items_per_consumer; i++)
+    {
+        const unsigned long *payload = (const unsigned long *)queueDequeue(run->queue);
+        for (size_t word = 0; word < run->payload_size / sizeof(unsigned long); word++)
+        {
+            checksum += payload[word];
+        }
+    }
+    atomic_fetch_add(&run->checksum, checksum);
+    return 0;
+}
+
+// Items per second draining the backlog with the given number of consumers
+double bench_payload_drain(const struct QueueOptions *options, size_t payload_size, int consumers, char *payloads, const size_t *order)
+{
+    size_t item_count = PAYLOAD_BYTES / payload_size;
+    struct PayloadRun run = {.queue = queueCreate(options), .payload_size = payload_size, .items_per_consumer = item_count / consumers};
+    atomic_init(&run.checksum, 0);
+    // The payloads are queued in shuffled order so that the hardware prefetcher cannot guess the next one
+    for (size_t i = 0; i < run.items_per_consumer * consumers; i++)
+    {
+        queueEnqueue(run.queue, payloads + order[i] * payload_size);
+    }
+    thrd_t threads[PAYLOAD_MAX_CONSUMERS];
+    struct timespec start;
+    struct timespec end;
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < consumers; i++)
+    {
+        thrd_create(&threads[i], payload_consumer, &run);
+    }
+    for (int i = 0; i < consumers; i++)
+    {
+        thrd_join(threads[i], NULL);
+    }
+    timespec_get(&end, TIME_UTC);
+    queueDestroy(run.queue);
+    return run.items_per_consumer * consumers / elapsed_seconds(&start, &end);
+}
+
+int run_payload(void)
+{
+    char *payloads = malloc(PAYLOAD_BYTES);
+    size_t *order = malloc(sizeof(size_t) * (PAYLOAD_BYTES / payload_sizes[0]));
+    memset(payloads, 1, PAYLOAD_BYTES);
+    const struct MatrixBackend backends[] = {{.name = "list", .backend = QUEUE_BACKEND_LIST}, {.name = "sharded", .backend = QUEUE_BACKEND_SHARDED}};
+    printf("%-16s %8s %9s %14s %16s %8s\n", "backend", "payload", "consumers", "plain items/s", "prefetch items/s", "gain");
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        for (size_t s = 0; s < sizeof(payload_sizes) / sizeof(payload_sizes[0]); s++)
+        {
+            size_t item_count = PAYLOAD_BYTES / payload_sizes[s];
+            uint64_t state = 0x9e3779b97f4a7c15u;
+            for (size_t i = 0; i < item_count; i++)
+            {
+                order[i] = i;
+            }
+            for (size_t i = item_count - 1; i > 0; i--)
+            {
+                state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+                size_t j = state % (i + 1);
+                size_t swapped = order[i];
+                order[i] = order[j];
+                order[j] = swapped;
+            }
+            for (int consumers = 1; consumers <= PAYLOAD_MAX_CONSUMERS; consumers++)
+            {
+                double plain = bench_payload_drain(&(struct QueueOptions){.backend = backends[b].backend}, payload_sizes[s], consumers, payloads, order);
+                double prefetched = bench_payload_drain(&(struct QueueOptions){.backend = backends[b].backend, .prefetch_next = true}, payload_sizes[s],
+                                                        consumers, payloads, order);
+                printf("%-16s %8zu %9d %14.0f %16.0f %+7.1f%%\n", backends[b].name, payload_sizes[s], consumers, plain, prefetched,
+                       (prefetched / plain - 1.0) * 100.0);
+            }
+        }
+    }
+    free(order);
+    free(payloads);
+    return 0;
+}
+
+#define SCALE_ITEMS_PER_PRODUCER 100000
+#define SCALE_DEFAULT_ROUNDS 3
+// Percentage by which throughput may fall below the baseline before the run fails
+#define SCALE_DEFAULT_THRESHOLD 10.0
+#define SCALE_AFFINITY_WORDS 16
+#define SCALE_BASELINE_LINE 512
+
+// Processors the benchmark started out allowed on, from which each cell takes the first few
+static unsigned long scale_affinity[SCALE_AFFINITY_WORDS];
+static bool scale_pinning;
+
+// One cell of the sweep, shared by its producers and consumers
+struct ScaleRun
+{
+    struct Queue *queue;
+    // Sum of the items dequeued, compared against the sum of those enqueued to catch lost or duplicated items
+    atomic_ulong checksum;
+};
+
+struct ScaleConsumer
+{
+    struct ScaleRun *run;
+    size_t items;
+};
+
+struct ScaleResult
+{
+    const char *backend;
+    int cores;
+    int producers;
+    int consumers;
+    double ops_per_sec;
+    double switches_per_op;
+    // Negative where the system offers no cache miss counter
+    double cache_misses_per_op;
+};
+
+// Counters of the whole process over one cell; -1 for one the system refused
+struct ScaleCounters
+{
+    int context_switches;
+    int cache_misses;
+    long rusage_switches;
+};
+
+int scale_producer(void *arg)
+{
+    struct ScaleRun *run = (struct ScaleRun *)arg;
+    for (uintptr_t i = 1; i <= SCALE_ITEMS_PER_PRODUCER; i++)
+    {
+        queueEnqueue(run->queue, (void *)i);
+    }
+    return 0;
+}
+
+int scale_consumer(void *arg)
+{
+    struct ScaleConsumer *consumer = (struct ScaleConsumer *)arg;
+    unsigned long checksum = 0;
+    for (size_t i = 0; i < consumer->items; i++)
+    {
+        checksum += (uintptr_t)queueDequeue(consumer->run->queue);
+    }
+    atomic_fetch_add(&consumer->run->checksum, checksum);
+    return 0;
+}
+
+int available_cores(void)
+{
+#ifdef PIN_TO_CORES
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(scale_affinity), scale_affinity) > 0)
+    {
+        scale_pinning = true;
+        int cores = 0;
+        for (size_t word = 0; word < SCALE_AFFINITY_WORDS; word++)
+        {
+            for (unsigned long bits = scale_affinity[word]; bits != 0; bits &= bits - 1)
+            {
+                cores++;
+            }
+        }
+        return cores;
+    }
+#endif
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    return processors > 0 ? (int)processors : 1;
+}
+
+// Confine the calling thread, and every thread it creates from now on, to the first cores it started out allowed on
+void restrict_to_cores(int cores)
+{
+#ifdef PIN_TO_CORES
+    if (!scale_pinning)
+    {
+        return;
+    }
+    unsigned long mask[SCALE_AFFINITY_WORDS] = {0};
+    size_t bits_per_word = 8 * sizeof(unsigned long);
+    for (size_t bit = 0; bit < SCALE_AFFINITY_WORDS * bits_per_word && cores > 0; bit++)
+    {
+        if ((scale_affinity[bit / bits_per_word] >> (bit % bits_per_word)) & 1)
+        {
+            mask[bit / bits_per_word] |= 1ul << (bit % bits_per_word);
+            cores--;
+        }
+    }
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#else
+    (void)cores;
+#endif
+}
+
+int open_perf_counter(uint32_t type, uint64_t config, bool exclude_kernel)
+{
+#ifdef COUNT_WITH_PERF_EVENTS
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.size = sizeof(attributes);
+    attributes.type = type;
+    attributes.config = config;
+    // Count this thread and every thread it creates from now on; each thread adds its counts in as it exits.
+    attributes.inherit = 1;
+    attributes.exclude_kernel = exclude_kernel;
+    attributes.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+#else
+    (void)type;
+    (void)config;
+    (void)exclude_kernel;
+    return -1;
+#endif
+}
+
+void start_scale_counters(struct ScaleCounters *counters)
+{
+    // Switches happen in the kernel, so they are only counted with it; cache misses are counted in user space alone where the kernel is off limits.
+    // Without a switch counter the process's own tally stands in for it.
+#ifdef COUNT_WITH_PERF_EVENTS
+    counters->context_switches = open_perf_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false);
+    counters->cache_misses = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false);
+    if (counters->cache_misses < 0)
+    {
+        counters->cache_misses = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true);
+    }
+#else
+    counters->context_switches = -1;
+    counters->cache_misses = -1;
+#endif
+    counters->rusage_switches = context_switches();
+}
+
+// Value of a counter since it was opened, which also closes it; -1 if it was never open
+long long stop_perf_counter(int descriptor)
+{
+    long long value = -1;
+    if (descriptor >= 0)
+    {
+        if (read(descriptor, &value, sizeof(value)) != (ssize_t)sizeof(value))
+        {
+            value = -1;
+        }
+        close(descriptor);
+    }
+    return value;
+}
+
+bool bench_scale_cell(const struct MatrixBackend *backend, int cores, struct ScaleResult *result)
+{
+    int producers = backend->max_producers > 0 && backend->max_producers < cores ? backend->max_producers : cores;
+    int consumers = backend->max_consumers > 0 && backend->max_consumers < cores ? backend->max_consumers : cores;
+    size_t total = (size_t)SCALE_ITEMS_PER_PRODUCER * producers;
+    struct ScaleRun run = {.queue = queueCreate(&(struct QueueOptions){.backend = backend->backend})};
+    atomic_init(&run.checksum, 0);
+    thrd_t *producer_threads = malloc(sizeof(thrd_t) * producers);
+    thrd_t *consumer_threads = malloc(sizeof(thrd_t) * consumers);
+    struct ScaleConsumer *consumer_args = malloc(sizeof(struct ScaleConsumer) * consumers);
+    struct ScaleCounters counters;
+    struct timespec start;
+    struct timespec end;
+
+    restrict_to_cores(cores);
+    start_scale_counters(&counters);
+    timespec_get(&start, TIME_UTC);
+    for (int i = 0; i < consumers; i++)
+    {
+        consumer_args[i] = (struct ScaleConsumer){.run = &run, .items = total / consumers + ((size_t)i < total % consumers)};
+        thrd_create(&consumer_threads[i], scale_consumer, &consumer_args[i]);
+    }
+    for (int i = 0; i < producers; i++)
+    {
+        thrd_create(&producer_threads[i], scale_producer, &run);
+    }
+    for (int i = 0; i < producers; i++)
+    {
+        thrd_join(producer_threads[i], NULL);
+    }
+    for (int i = 0; i < consumers; i++)
+    {
+        thrd_join(consumer_threads[i], NULL);
+    }
+    timespec_get(&end, TIME_UTC);
+    long long switches = stop_perf_counter(counters.context_switches);
+    long long misses = stop_perf_counter(counters.cache_misses);
+    if (switches < 0)
+    {
+        switches = context_switches() - counters.rusage_switches;
+    }
+    restrict_to_cores(available_cores());
+    queueDestroy(run.queue);
+    free(producer_threads);
+    free(consumer_threads);
+    free(consumer_args);
+
+    double operations = 2.0 * total;
+    *result = (struct ScaleResult){
+        .backend = backend->name,
+        .cores = cores,
+        .producers = producers,
+        .consumers = consumers,
+        .ops_per_sec = operations / elapsed_seconds(&start, &end),
+        .switches_per_op = switches / operations,
+        .cache_misses_per_op = misses < 0 ? -1.0 : misses / operations,
+    };
+    unsigned long expected = (unsigned long)producers * SCALE_ITEMS_PER_PRODUCER * (SCALE_ITEMS_PER_PRODUCER + 1) / 2;
+    return atomic_load(&run.checksum) == expected;
+}
+
+// Core counts of the sweep: powers of two, then all available cores; 0 once the sweep is over
+int next_core_count(int cores, int max_cores)
+{
+    if (cores >= max_cores)
+    {
+        return 0;
+    }
+    return cores * 2 < max_cores ? cores * 2 : max_cores;
+}
+
+// Throughput an earlier run recorded for the same backend and core count, or 0 if it recorded none.
+// The baseline is a file this benchmark wrote, one result to a line, so it is read back with string searches rather than a JSON parser.
+double baseline_throughput(FILE *baseline, const char *backend, int cores)
+{
+    char key[SCALE_BASELINE_LINE];
+    char line[SCALE_BASELINE_LINE];
+    const char *field = "\"ops_per_sec\": ";
+    snprintf(key, sizeof(key), "{\"backend\": \"%s\", \"cores\": %d,", backend, cores);
+    rewind(baseline);
+    while (fgets(line, sizeof(line), baseline) != NULL)
+    {
+        const char *value = strstr(line, key) != NULL ? strstr(line, field) : NULL;
+        if (value != NULL)
+        {
+            return strtod(value + strlen(field), NULL);
+        }
+    }
+    return 0;
+}
+
+void write_scale_results(FILE *file, const struct ScaleResult *results, size_t count)
+{
+    fprintf(file, "{\n  \"layout\": \"%s\",\n  \"parking\": \"%s\",\n  \"items_per_producer\": %d,\n  \"results\": [\n", BENCH_LAYOUT, BENCH_PARKING,
+            SCALE_ITEMS_PER_PRODUCER);
+    for (size_t i = 0; i < count; i++)
+    {
+        fprintf(file, "    {\"backend\": \"%s\", \"cores\": %d, \"producers\": %d, \"consumers\": %d, \"ops_per_sec\": %.0f, \"context_switches_per_op\": %.6f, ",
+                results[i].backend, results[i].cores, results[i].producers, results[i].consumers, results[i].ops_per_sec, results[i].switches_per_op);
+        if (results[i].cache_misses_per_op < 0)
+        {
+            fprintf(file, "\"cache_misses_per_op\": null}");
+        }
+        else
+        {
+            fprintf(file, "\"cache_misses_per_op\": %.6f}", results[i].cache_misses_per_op);
+        }
+        fprintf(file, "%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+int run_scale(int argc, char **argv)
+{
+    int rounds = SCALE_DEFAULT_ROUNDS;
+    int max_cores = available_cores();
+    double threshold = SCALE_DEFAULT_THRESHOLD;
+    const char *output_path = "bench-scale.json";
+    const char *baseline_path = NULL;
+    for (int i = 0; i < argc; i += 2)
+    {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value != NULL && strcmp(argv[i], "--rounds") == 0)
+        {
+            rounds = atoi(value) > 0 ? atoi(value) : 1;
+        }
+        else if (value != NULL && strcmp(argv[i], "--max-cores") == 0)
+        {
+            max_cores = atoi(value) > 0 && atoi(value) < max_cores ? atoi(value) : max_cores;
+        }
+        else if (value != NULL && strcmp(argv[i], "--threshold") == 0)
+        {
+            threshold = strtod(value, NULL);
+        }
+        else if (value != NULL && strcmp(argv[i], "--output") == 0)
+        {
+            output_path = value;
+        }
+        else if (value != NULL && strcmp(argv[i], "--baseline") == 0)
+        {
+            baseline_path = value;
+        }
+        else
+        {
+            fprintf(stderr, "bench scale: unknown or incomplete option %s\n", argv[i]);
+            return 2;
+        }
+    }
+    FILE *baseline = baseline_path != NULL ? fopen(baseline_path, "r") : NULL;
+    if (baseline_path != NULL && baseline == NULL)
+    {
+        fprintf(stderr, "bench scale: cannot read baseline %s\n", baseline_path);
+        return 2;
+    }
+
+    size_t backend_count = sizeof(matrix_backends) / sizeof(matrix_backends[0]);
+    size_t result_count = 0;
+    struct ScaleResult *results = malloc(sizeof(struct ScaleResult) * backend_count * (2 + 8 * sizeof(int)));
+    int failures = 0;
+    printf("%-16s %5s %9s %9s %12s %11s %11s %12s %8s\n", "backend", "cores", "producers", "consumers", "ops/sec", "switches/op", "misses/op",
+           "baseline", "change");
+    for (size_t b = 0; b < backend_count; b++)
+    {
+        for (int cores = 1; cores != 0; cores = next_core_count(cores, max_cores))
+        {
+            // The best of several rounds is kept, since noise only ever slows a round down
+            struct ScaleResult best = {0};
+            bool intact = true;
+            for (int round = 0; round < rounds; round++)
+            {
+                struct ScaleResult result;
+                intact = bench_scale_cell(&matrix_backends[b], cores, &result) && intact;
+                if (result.ops_per_sec > best.ops_per_sec)
+                {
+                    best = result;
+                }
+            }
+            results[result_count++] = best;
+            double expected = baseline != NULL ? baseline_throughput(baseline, best.backend, cores) : 0;
+            bool regressed = expected > 0 && best.ops_per_sec < expected * (1.0 - threshold / 100.0);
+            failures += !intact || regressed;
+            printf("%-16s %5d %9d %9d %12.0f %11.4f %11.4f %12.0f %+7.1f%% %s\n", best.backend, cores, best.producers, best.consumers, best.ops_per_sec,
+                   best.switches_per_op, best.cache_misses_per_op, expected, expected > 0 ? (best.ops_per_sec / expected - 1.0) * 100.0 : 0.0,
+                   !intact ? "LOST OR DUPLICATED ITEMS" : regressed ? "REGRESSED" : "");
+        }
+    }
+    if (baseline != NULL)
+    {
+        fclose(baseline);
+    }
+
+    FILE *output = fopen(output_path, "w");
+    if (output == NULL)
+    {
+        fprintf(stderr, "bench scale: cannot write %s\n", output_path);
+        free(results);
+        return 2;
+    }
+    write_scale_results(output, results, result_count);
+    fclose(output);
+    free(results);
+    if (failures > 0)
+    {
+        fprintf(stderr, "bench scale: %d cells failed\n", failures);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "matrix") == 0)
+    {
+        return run_matrix(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "scale") == 0)
+    {
+        return run_scale(argc - 2, argv + 2);
+    }
+    if (argc > 1 && strcmp(argv[1], "payload") == 0)
+    {
+        return run_payload();
+    }
+
+    bench_backend("list", &(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    bench_backend("ring", &(struct QueueOptions){.backend = QUEUE_BACKEND_RING});
+    bench_backend("lock-free-list", &(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+    bench_backend("list+spin", &(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .spin_limit = 2048});
+    bench_backend("ring+spin", &(struct QueueOptions){.backend = QUEUE_BACKEND_RING, .spin_limit = 2048});
+    bench_backend("list+handoff", &(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .direct_hand_off = true});
+    bench_backend("sharded", &(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED});
+
+    return 0;
+}
@@ -2,325 +2,4299 @@
 #include <threads.h>
 #include <stdatomic.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+// Building with QUEUE_FUTEX_PARKING parks waiters on a futex word of their own instead of a condition variable; the flag is ignored outside Linux.
+#if defined(QUEUE_FUTEX_PARKING) && defined(__linux__)
+#include <linux/futex.h>
+#define PARK_ON_FUTEX
+#endif
+// Building with QUEUE_NUMA_PLACEMENT keeps an element pool per NUMA node and binds each sharded lane to a node; the flag is ignored outside Linux.
+#if defined(QUEUE_NUMA_PLACEMENT) && defined(__linux__)
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#define PLACE_ON_NUMA_NODES
+#endif
+// Threads blocked on a shared-memory queue sleep on futex words in the region where the system has them, and poll the region elsewhere.
+#ifdef __linux__
+#include <linux/futex.h>
+#define SHARE_FUTEX_WORDS
+#endif
+#if defined(PARK_ON_FUTEX) || defined(PLACE_ON_NUMA_NODES) || defined(SHARE_FUTEX_WORDS)
+#include <sys/syscall.h>
+// Strict C11 builds leave syscall() undeclared.
+long syscall(long number, ...);
+#endif
+// Nor do they declare ftruncate(), which is the only way to size a shared memory object, or posix_fallocate(), which reserves the blocks of a segment file.
+int ftruncate(int descriptor, off_t length);
+int posix_fallocate(int descriptor, off_t offset, off_t length);
+// The readiness descriptor is an eventfd where the system has one and a pipe elsewhere.
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define READINESS_EVENTFD
+#endif
+// The stats clock reads the time stamp counter where the compiler can reach it, and falls back to timespec_get() elsewhere.
+#if defined(QUEUE_STATS) && (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define STATS_CLOCK_TSC
+#endif
+// Software prefetches are issued where the compiler offers them and compile to nothing elsewhere; a prefetch never faults, whatever the address.
+#ifdef __GNUC__
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address) ((void)0)
+#endif
 
 
+// Size of the unit of cache coherence; fields written by different sides of the queue are kept on separate lines so that they never falsely share.
+#define CACHE_LINE_SIZE 64
+// Building with QUEUE_PACKED_LAYOUT drops the padding, which is only useful for measuring what the padding buys.
+#ifdef QUEUE_PACKED_LAYOUT
+#define CACHE_ALIGNED
+#else
+#define CACHE_ALIGNED alignas(CACHE_LINE_SIZE)
+#endif
+// Building with QUEUE_STATS compiles in the hot-path statistics reported by queueStats(); otherwise every RECORD_STAT() vanishes.
+#ifdef QUEUE_STATS
+#define RECORD_STAT(statement) statement
+#else
+#define RECORD_STAT(statement) ((void)0)
+#endif
+
+// Number of cache lines each of the enqueue and dequeue tallies is spread over.
+#define COUNTER_STRIPES 16
+
+// One thread's share of a striped counter, alone on its cache line.
+struct CounterStripe
+{
+    CACHE_ALIGNED atomic_ulong value;
+};
+
+// A tally that threads add to on stripes of their own and that readers sum, so that concurrent updates never contend for one cache line.
+struct StripedCounter
+{
+    struct CounterStripe stripes[COUNTER_STRIPES];
+};
+
 // Oversees the management of a thread queue, keeping tabs on the head and tail, as well as the tally of threads lined up for processing.
 struct ThreadQueue
 {
-    struct QueueNode *head;
+    CACHE_ALIGNED struct QueueNode *head;
     struct QueueNode *tail;
     atomic_ulong waiting_thread_count;
+    // Oldest waiter no producer has picked yet; every node ahead of it has been promised an item.
+    struct QueueNode *first_unclaimed;
+    // Continuations lined up or still running; only the consumers' line ever has any, and while it has none the single-consumer backends pop without taking turns.
+    atomic_ulong continuation_count;
+    // Slots already promised to picked producers that have not filled them yet, and which nobody else may fill; a picked consumer is handed its item at once, so consumers never count here.
+    size_t claimed_count;
 };
 
-// Describes an individual thread node within the queue, detailing its unique ID, successor, synchronization condition variable, completion state, and condition to wait for.
+// Describes an individual thread node within the queue, detailing its unique ID, neighbours, synchronization condition variable, completion state, and condition to wait for.
+// Every thread owns exactly one node for its whole lifetime and links it into the thread queue each time it has to block.
 struct QueueNode
 {
-    thrd_t id;
+    thrd_t thread_id;
     struct QueueNode *successor;
+    struct QueueNode *predecessor;
+#ifdef PARK_ON_FUTEX
+    // Futex word the thread sleeps on: 1 from just before the thread unlocks to sleep until a signal or the end of its wait resets it, 0 otherwise.
+    atomic_uint parked;
+#else
     // Dedicated condition variable for selective thread notification.
     cnd_t sync_condition;
-    bool terminated;
-    int wait_condition;
+#endif
+    bool linked;
+    // Set under the lock by the thread that picked this waiter: the producer of the item it will take, or the consumer that freed the slot it will fill.
+    bool claimed;
+    // Set when the producer that picked this node wrote the item into it, either instead of adding it to the data queue or by taking it back out of it.
+    bool handed_off;
+    void *handed_off_pointer;
+    // Signals promised to this node but not yet delivered, since producers signal only after unlocking.
+    atomic_uint pending_signals;
+    // Number of polls this thread currently spends before parking, grown after spins that paid off and shrunk after ones that did not.
+    unsigned spin_budget;
+    // Set on a node lined up by queueAsyncDequeue() in place of a thread, which is never signalled: whoever takes its item for it runs the continuation
+    // with the item in handed_off_pointer once unlocked, and frees the node.
+    void (*continuation)(void *context, void *item);
+    void *continuation_context;
 };
 
 // Organizes a queue for generic data items, containing pointers to the first and last entries, and maintains metrics for total size, number of processed items, and quantity of items entered.
+// The read-only configuration, the lock with the pointers it guards, and each counter sit on lines of their own, so that polling size(), visited() or waiting() never steals the line a producer or consumer is writing.
 struct DataQueue
 {
+    CACHE_ALIGNED enum QueueBackend backend;
+    unsigned spin_limit;
+    bool direct_hand_off;
+    bool prefetch_next;
+    // Most items the list backend holds before producers block; 0 leaves it unbounded.
+    size_t capacity;
+    // Set once by queueClose(), under the lock; from then on no new item is accepted and no consumer parks.
+    atomic_bool closed;
+    // Set once destruction starts; from then on calls return at once, as on a closed queue with nothing left.
+    atomic_bool destroyed;
+    CACHE_ALIGNED mtx_t synchronization_lock;
     struct DataElement *head;
     struct DataElement *tail;
-    atomic_ulong total_size;
-    atomic_ulong items_processed;
-    atomic_ulong items_enqueued;
-    mtx_t synchronization_lock;
+    // The list is kept ordered from the highest priority down, each priority forming one run; these are the last elements of each run.
+    struct DataElement *priority_tails[QUEUE_PRIORITY_LEVELS];
+    // Written by producers only.
+    struct StripedCounter items_enqueued;
+    // Written by consumers only.
+    struct StripedCounter items_processed;
+    // Exact number of queued items, written under the lock by both sides; only the list backend keeps it, the lock-free ones derive their size from the two tallies.
+    CACHE_ALIGNED atomic_ulong total_size;
 };
 
-// Characterizes an individual node within the data queue, holding a reference to the subsequent node, an identifier for the data, and the pointer to the data itself.
+// Characterizes an individual node within the data queue, holding a reference to the subsequent node, the priority of the data, and the pointer to the data itself.
 struct DataElement
 {
     struct DataElement *next;
-    int index;
+    int priority;
+    void *pointer;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_at;
+#endif
+};
+
+// A contiguous block of data elements carved from the heap in a single allocation and owned by the element pool until the last queue is destroyed.
+struct ElementSlab
+{
+    struct ElementSlab *next;
+    size_t element_count;
+    struct DataElement elements[];
+};
+
+// Process-wide reservoir of recycled data elements shared by every queue instance, refilled one slab at a time and guarded by its own lock so that it never contends with a data queue.
+// Sharing one pool keeps the thread caches valid whichever queue a thread happens to be feeding; the slabs are released once the last queue is destroyed.
+// NUMA placement keeps one pool per node, whose slabs are bound to that node.
+struct ElementPool
+{
+    struct ElementSlab *slabs;
+    struct DataElement *free_list;
+    size_t free_count;
+    // Kept by the first pool on behalf of all of them.
+    size_t live_queue_count;
+    atomic_ulong generation;
+    mtx_t pool_lock;
+};
+
+// Private stash of data elements belonging to a single thread, usable with any queue and tagged with the pool, and the generation of it, that it was filled from.
+struct ElementCache
+{
+    struct DataElement *head;
+    size_t count;
+    unsigned long generation;
+    struct ElementPool *pool;
+};
+
+// One slot of the ring backend; the sequence number tells producers and consumers whose turn it is to touch the slot.
+struct RingCell
+{
+    atomic_size_t sequence;
+    void *pointer;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_at;
+#endif
+};
+
+// Bounded multi-producer multi-consumer ring in which producers and consumers claim slots by advancing their own position with compare-and-swap.
+// The producer and consumer positions live on separate lines, away from the read-only slot array pointer.
+struct RingQueue
+{
+    CACHE_ALIGNED struct RingCell *cells;
+    size_t mask;
+    CACHE_ALIGNED atomic_size_t enqueue_position;
+    CACHE_ALIGNED atomic_size_t dequeue_position;
+};
+
+// Element of the lock-free list backend, linked through an atomic pointer so that producers can append with compare-and-swap.
+struct LockFreeElement
+{
+    _Atomic(struct LockFreeElement *) next;
+    void *pointer;
+    // Links the element into its thread's retired or reclaimed list; next is left alone, since a producer holding a stale tail may still compare-and-swap it.
+    struct LockFreeElement *retired_next;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_at;
+#endif
+};
+
+// Unbounded Michael-Scott list whose head always points at a dummy element, the real items following it.
+struct LockFreeList
+{
+    CACHE_ALIGNED _Atomic(struct LockFreeElement *) head;
+    CACHE_ALIGNED _Atomic(struct LockFreeElement *) tail;
+};
+
+// One slot of the single-producer ring; unlike a RingCell it needs no sequence number, since the two indices alone tell which slots hold items.
+struct SpscSlot
+{
+    void *pointer;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_at;
+#endif
+};
+
+// Bounded ring for one producer and one consumer. Each side publishes its own index with a release store and keeps a private copy of the other side's,
+// reading the shared one again only when its copy makes the ring look full or empty, so that in steady state neither side touches the other's line.
+struct SpscRing
+{
+    CACHE_ALIGNED struct SpscSlot *slots;
+    size_t mask;
+    // Written by the consumer only, next to its copy of the producer's index.
+    CACHE_ALIGNED atomic_size_t head;
+    size_t cached_tail;
+    // Held around every pop made while continuations are around; see popAsSingleConsumer().
+    atomic_flag popping;
+    // Written by the producer only, next to its copy of the consumer's index.
+    CACHE_ALIGNED atomic_size_t tail;
+    size_t cached_head;
+};
+
+// Element of the single-consumer list, linked to its successor by the producer that appended the successor. It is laid over a data element drawn from the element pool.
+struct MpscElement
+{
+    _Atomic(struct MpscElement *) next;
     void *pointer;
+#ifdef QUEUE_STATS
+    uint64_t enqueued_at;
+#endif
+};
+
+// Vyukov's list for many producers and one consumer: producers append with one unconditional exchange of the tail, and the consumer walks from the head with plain loads.
+// A stub element embedded in the list is linked back in whenever the consumer is about to take the last element, so that the head never becomes NULL.
+struct MpscList
+{
+    CACHE_ALIGNED _Atomic(struct MpscElement *) tail;
+    CACHE_ALIGNED struct MpscElement *head;
+    // Held around every pop made while continuations are around; see popAsSingleConsumer().
+    atomic_flag popping;
+    struct MpscElement stub;
+};
+
+// A link has to hold the element of either list backend that may be laid over it.
+_Static_assert(sizeof(struct DataElement) <= sizeof(struct QueueLink) && alignof(struct DataElement) <= alignof(struct QueueLink), "QueueLink too small for a DataElement");
+_Static_assert(sizeof(struct MpscElement) <= sizeof(struct QueueLink) && alignof(struct MpscElement) <= alignof(struct QueueLink), "QueueLink too small for an MpscElement");
+_Static_assert(sizeof(struct MpscElement) <= sizeof(struct DataElement) && alignof(struct MpscElement) <= alignof(struct DataElement), "DataElement too small for an MpscElement");
+
+// Independent list queues the sharded backend spreads its items over; each thread produces into and consumes from its own lane first.
+struct ShardedQueue
+{
+    struct Queue **lanes;
+    size_t lane_count;
+    // Lane i lives on NUMA node i modulo the node count, which is 1 without NUMA placement.
+    size_t node_count;
+};
+
+// Number of elements a thread may protect at once while walking the lock-free list.
+#define HAZARDS_PER_THREAD 2
+
+// Per-thread hazard pointers announcing which list elements must not be reclaimed, together with the elements the thread has retired or recycled.
+// Records are kept in a process-wide registry and handed to a new thread once their owner exits.
+struct HazardRecord
+{
+    CACHE_ALIGNED _Atomic(struct LockFreeElement *) hazards[HAZARDS_PER_THREAD];
+    atomic_bool active;
+    struct HazardRecord *next;
+    struct LockFreeElement *retired;
+    size_t retired_count;
+    struct LockFreeElement *reclaimed;
+    size_t reclaimed_count;
+};
+
+// Number of retired elements a thread accumulates before scanning the hazard pointers for ones it can reuse.
+#define HAZARD_RETIRE_THRESHOLD 64
+// Number of reclaimed elements a thread keeps for reuse before returning the surplus to the heap.
+#define HAZARD_RECLAIMED_CAPACITY 256
+
+// Number of slots given to the ring backend when no capacity is requested.
+#define RING_DEFAULT_CAPACITY 1024
+// Identifies a segment file laid out by this queue.
+#define SEGMENT_MAGIC "QSEGMNT1"
+// Interval at which threads blocked on a shared memory region poll it where they cannot sleep on a futex, in nanoseconds.
+#define SHARED_POLL_INTERVAL_NS 100000
+// Longest a queue attaching to a shared memory region waits for the queue that created it to size it and lay it out, in nanoseconds.
+#define SHARED_ATTACH_TIMEOUT_NS 1000000000L
+
+#ifdef QUEUE_STATS
+// One thread's share of a latency histogram; only the stripe starts a cache line, the buckets within it are packed.
+struct HistogramStripe
+{
+    CACHE_ALIGNED atomic_ulong buckets[QUEUE_LATENCY_BUCKETS];
+};
+
+// A histogram striped like a StripedCounter, but a whole stripe at a time, so that it costs a few kilobytes rather than a padded line per bucket.
+struct LatencyHistogram
+{
+    struct HistogramStripe stripes[COUNTER_STRIPES];
+};
+
+// Time the stats clock is calibrated over, in nanoseconds.
+#define STATS_CLOCK_CALIBRATION_NS 5000000
+
+// Hot-path statistics of one queue instance, kept in striped counters so that recording them does not serialize the threads being observed.
+struct QueueStatCounters
+{
+    struct StripedCounter lock_acquisitions;
+    struct StripedCounter lock_contentions;
+    struct StripedCounter parks;
+    struct StripedCounter wakeups;
+    struct StripedCounter spurious_wakeups;
+    CACHE_ALIGNED atomic_size_t max_depth;
+    struct LatencyHistogram time_in_queue;
+};
+#endif
+
+// Start of a segment file. Its alignment is spelled out rather than taken from CACHE_ALIGNED so that every build of the queue lays files out alike.
+struct SegmentHeader
+{
+    char magic[8];
+    uint64_t record_size;
+    uint64_t slot_count;
+    // Positions of the ring, both kept in the file so that a queue opened on it again resumes from them.
+    alignas(CACHE_LINE_SIZE) _Atomic uint64_t enqueue_position;
+    alignas(CACHE_LINE_SIZE) _Atomic uint64_t dequeue_position;
+};
+
+// One slot of a segment file; the sequence number plays the part it plays in a ring cell, and the payload follows it.
+struct SegmentRecord
+{
+    _Atomic uint64_t sequence;
+    unsigned char payload[];
+};
+
+// Start of a shared memory region: the header of the segment laid out in it, followed by the words that blocked threads of every attached process sleep on.
+struct SharedRegionHeader
+{
+    struct SegmentHeader segment;
+    // Bumped by a producer that publishes a record while consumers sleep, and by a consumer that releases one while producers sleep; sleepers wait for it to change.
+    alignas(CACHE_LINE_SIZE) _Atomic uint32_t item_signal;
+    _Atomic uint32_t sleeping_consumers;
+    alignas(CACHE_LINE_SIZE) _Atomic uint32_t room_signal;
+    _Atomic uint32_t sleeping_producers;
+    // Set by the queue that created the region once it is laid out; queues attaching to it wait for it first.
+    alignas(CACHE_LINE_SIZE) _Atomic uint32_t ready;
+    // Queues attached to the region, the last of which removes it.
+    _Atomic uint32_t attached_count;
+};
+
+// Ring of records in a memory-mapped file or shared memory region. Unlike a ring cell, a slot is not handed back to producers by the dequeue but by the release that follows it,
+// so that consumers work on the record in place and a record dequeued but not yet released survives a restart.
+struct SegmentQueue
+{
+    CACHE_ALIGNED struct SegmentHeader *header;
+    // The region the header starts, or NULL for a segment file.
+    struct SharedRegionHeader *shared;
+    // Copy of the region's name, kept to remove it.
+    char *shared_name;
+    unsigned char *records;
+    size_t record_size;
+    size_t record_stride;
+    size_t mask;
+    size_t mapping_size;
+    int descriptor;
+    size_t sync_every;
+    // Enqueues since the queue was opened, counted only when syncs are batched.
+    CACHE_ALIGNED atomic_size_t enqueue_count;
+};
+
+// Descriptor an event loop polls instead of blocking in a dequeue, made readable by the producer that finds it not readable yet.
+struct ReadinessNotification
+{
+    // Both -1 for a queue created without one; the same eventfd twice, or the two ends of a pipe.
+    CACHE_ALIGNED int read_descriptor;
+    int write_descriptor;
+    // Set by the producer that made the descriptor readable and cleared by the consumer that found the queue empty; producers only read it in between.
+    CACHE_ALIGNED atomic_bool pending;
+};
+
+// A self-contained queue instance: its data queue, the consumers and producers blocked on it and the state of whichever backend it was created with.
+struct Queue
+{
+    alignas(CACHE_LINE_SIZE) struct DataQueue data;
+    struct ThreadQueue threads;
+    struct ThreadQueue producers;
+    struct RingQueue ring;
+    struct LockFreeList lock_free_list;
+    struct ShardedQueue sharded;
+    struct SpscRing spsc_ring;
+    struct MpscList mpsc_list;
+    struct SegmentQueue segment;
+    struct ReadinessNotification readiness;
+    // Threads currently inside a call on the queue, parked or not, which destroying it waits for; each thread counts itself on its own stripe.
+    struct StripedCounter occupants;
+#ifdef QUEUE_STATS
+    struct QueueStatCounters stats;
+#endif
 };
 
+// Smallest spin budget a thread decays to, so that a few hits are enough to grow it again.
+#define SPIN_BUDGET_FLOOR 16
+// Number of polls between two yields of the processor while spinning.
+#define SPIN_POLLS_PER_YIELD 64
+// Number of waiters a batch enqueue remembers so that it can signal them after unlocking.
+#define QUEUE_WAKE_BATCH 64
 
+// Number of elements carved out of the heap whenever the shared pool runs dry.
+#define ELEMENT_SLAB_SIZE 256
+// Number of elements moved between a thread cache and the shared pool in a single exchange.
+#define ELEMENT_CACHE_BATCH 32
+// Number of elements a thread may hold privately before handing a batch back to the shared pool.
+#define ELEMENT_CACHE_CAPACITY 64
+// Number of element pools, one per NUMA node under NUMA placement; nodes beyond the last pool share pools with lower ones.
+#ifdef PLACE_ON_NUMA_NODES
+#define ELEMENT_POOL_COUNT 8
+#else
+#define ELEMENT_POOL_COUNT 1
+#endif
 
-static struct ThreadQueue thread_queue;
-static struct DataQueue data_queue;
-static thrd_t current_thread;
 
 
-void removeAllDataElements(void);
-void teardownThreadQueue(void);
+static struct Queue defaultQueue;
+static struct ElementPool elementPools[ELEMENT_POOL_COUNT];
+static once_flag element_pool_once = ONCE_FLAG_INIT;
+static _Atomic(struct HazardRecord *) hazard_records;
+static _Thread_local struct HazardRecord *hazard_record;
+static tss_t hazard_record_key;
+static once_flag hazard_record_key_once = ONCE_FLAG_INIT;
+static atomic_ulong pool_generation;
+static _Thread_local struct ElementCache element_cache;
+static tss_t element_cache_key;
+static _Thread_local struct QueueNode thread_waiter;
+static _Thread_local bool thread_waiter_ready;
+static tss_t thread_waiter_key;
+static once_flag thread_waiter_key_once = ONCE_FLAG_INIT;
+static _Thread_local size_t thread_number;
+static atomic_size_t next_thread_number;
+static _Thread_local size_t thread_node;
+static size_t numa_node_count = 1;
+static once_flag numa_topology_once = ONCE_FLAG_INIT;
+#ifdef QUEUE_STATS
+static once_flag stats_clock_once = ONCE_FLAG_INIT;
+// Nanoseconds per tick of the stats clock, which is 1 unless the time stamp counter is in use.
+static double stats_clock_scale = 1.0;
+static bool stats_clock_uses_tsc;
+#endif
+
+
+void removeAllDataElements(struct Queue *queue);
+void initThreadQueue(struct ThreadQueue *threadQueue);
+void wakeAllWaiters(struct ThreadQueue *threadQueue);
 struct DataElement *createDataElement(void *data);
-void appendToDataQueue(struct DataElement *elementToAdd);
-void appendToEmptyDataQueue(struct DataElement *elementToAdd);
-void appendToPopulatedDataQueue(struct DataElement *elementToAdd);
-bool checkIfThreadShouldYield(void);
-void enqueueQueueNode(void);
-void dequeueQueueNode(void);
-void appendToThreadQueue(struct QueueNode *nodeToAdd);
-void appendToEmptyThreadQueue(struct QueueNode *nodeToAdd);
-void appendToPopulatedThreadQueue(struct QueueNode *nodeToAdd);
-struct QueueNode *createThreadQueueNode(void);
-int fetchFirstWaitConditionStatus(void);
+void releaseDataElement(struct DataElement *element);
+void recycleDataElement(struct DataElement *element);
+struct DataElement *adoptQueueLink(struct QueueLink *link);
+bool isQueueLink(struct DataElement *element);
+struct Queue *createQueueOnNode(const struct QueueOptions *options, size_t node);
+bool initQueueInstance(struct Queue *queue, const struct QueueOptions *options);
+void destroyQueueInstance(struct Queue *queue);
+void closeAdmitted(struct Queue *queue);
+bool enqueueAdmitted(struct Queue *queue, void *data, const struct timespec *deadline);
+void enqueuePriorityAdmitted(struct Queue *queue, void *data, int priority);
+void enqueueIntrusiveAdmitted(struct Queue *queue, struct QueueLink *link);
+bool tryEnqueueAdmitted(struct Queue *queue, void *data);
+bool dequeueAdmitted(struct Queue *queue, void **dataPointer, const struct timespec *deadline);
+bool tryDequeueAdmitted(struct Queue *queue, void **dataPointer);
+void enqueueBatchAdmitted(struct Queue *queue, void **items, size_t count);
+size_t dequeueBatchAdmitted(struct Queue *queue, void **items, size_t max_items);
+size_t tryDequeueBatchAdmitted(struct Queue *queue, void **items, size_t max_items);
+void releaseRecordAdmitted(struct Queue *queue, void *record);
+size_t countVisitedItems(struct Queue *queue);
+void asyncDequeueAdmitted(struct Queue *queue, void (*callback)(void *context, void *item), void *context);
+bool enterQueue(struct Queue *queue);
+void leaveQueue(struct Queue *queue);
+void attachToElementPool(size_t reserved_elements);
+void detachFromElementPool(void);
+void lockElementPools(void);
+void unlockElementPools(void);
+void createElementPool(void);
+void carveElementSlab(struct ElementPool *pool, size_t element_count);
+bool takeFromElementPool(struct ElementPool *pool, struct ElementCache *cache);
+void refillElementCache(struct ElementCache *cache);
+void flushElementCache(struct ElementCache *cache, size_t element_count);
+struct ElementCache *fetchElementCache(void);
+void returnElementCacheOnExit(void *cache);
+void appendToDataQueue(struct Queue *queue, struct DataElement *elementToAdd);
+void appendToEmptyDataQueue(struct Queue *queue, struct DataElement *elementToAdd);
+void appendToPopulatedDataQueue(struct Queue *queue, struct DataElement *elementToAdd);
+void insertByPriority(struct Queue *queue, struct DataElement *elementToAdd);
+void appendChainToDataQueue(struct Queue *queue, struct DataElement *chainHead, struct DataElement *chainTail, size_t count);
+struct DataElement *detachDataElements(struct Queue *queue, size_t count);
+bool waitForDataElement(struct Queue *queue, const struct timespec *deadline);
+bool enqueueToList(struct Queue *queue, void *data, int priority, const struct timespec *deadline, bool mayWait, bool intrusive);
+bool waitForFreeSlot(struct Queue *queue, const struct timespec *deadline, bool mayWait);
+size_t countFreeSlots(struct Queue *queue);
+struct QueueNode *claimFreedSlot(struct Queue *queue);
+size_t claimFreedSlots(struct Queue *queue, struct QueueNode **nodesToWake);
+bool hasDeadlinePassed(const struct timespec *deadline);
+bool spinUntilClaimable(struct Queue *queue);
+bool spinUntilPopped(struct Queue *queue, void **dataPointer);
+unsigned fetchSpinBudget(struct Queue *queue);
+void adaptSpinBudget(struct Queue *queue, bool spinPaidOff);
+void relaxProcessor(unsigned iteration);
+bool waitOnThreadQueueNode(struct Queue *queue, struct QueueNode *node, const struct timespec *deadline);
+void signalQueueNode(struct QueueNode *node);
+struct QueueNode *claimNextWaiter(struct ThreadQueue *threadQueue);
+struct QueueNode *bindNextWaiter(struct Queue *queue);
+struct QueueNode *handOffToNextWaiter(struct Queue *queue, void *data);
+bool takeHandedOffItem(void **dataPointer);
+void enqueueBatchByHandOff(struct Queue *queue, void **items, size_t count);
+void collectWaiterToWake(struct QueueNode **nodesToWake, size_t *wakeCount, struct QueueNode *node);
+struct QueueNode *reserveHeadWaiter(struct ThreadQueue *threadQueue);
+void wakeReservedWaiter(struct QueueNode *node);
+void wakeReservedWaiters(struct QueueNode **nodes, size_t count);
+struct QueueNode *enqueueQueueNode(struct ThreadQueue *threadQueue);
+void dequeueQueueNode(struct ThreadQueue *threadQueue, struct QueueNode *nodeToRemove);
+void appendToThreadQueue(struct ThreadQueue *threadQueue, struct QueueNode *nodeToAdd);
+void appendToEmptyThreadQueue(struct ThreadQueue *threadQueue, struct QueueNode *nodeToAdd);
+void appendToPopulatedThreadQueue(struct ThreadQueue *threadQueue, struct QueueNode *nodeToAdd);
+struct QueueNode *prepareThreadQueueNode(void);
+struct QueueNode *fetchThreadQueueNode(void);
+void createThreadWaiterKey(void);
+void destroyThreadQueueNodeOnExit(void *node);
+void initRingQueue(struct Queue *queue, size_t capacity);
+void destroyRingQueue(struct Queue *queue);
+bool pushToRing(struct Queue *queue, void *data);
+bool popFromRing(struct Queue *queue, void **dataPointer);
+bool enqueueWithoutLock(struct Queue *queue, void *data, const struct timespec *deadline);
+void wakeHeadWaiterAfterPush(struct Queue *queue);
+bool pushInTurn(struct Queue *queue, void *data, const struct timespec *deadline);
+void passTurnToNextProducer(struct Queue *queue);
+void wakeHeadProducerAfterPop(struct Queue *queue);
+bool dequeueWithoutLock(struct Queue *queue, void **dataPointer, const struct timespec *deadline);
+void enqueueBatchWithoutLock(struct Queue *queue, void **items, size_t count);
+bool pushWithoutLock(struct Queue *queue, void *data);
+bool popWithoutLock(struct Queue *queue, void **dataPointer);
+void initLockFreeList(struct Queue *queue);
+void destroyLockFreeList(struct Queue *queue);
+bool pushToLockFreeList(struct Queue *queue, void *data);
+bool popFromLockFreeList(struct Queue *queue, void **dataPointer);
+struct LockFreeElement *createLockFreeElement(void *data);
+void retireLockFreeElement(struct LockFreeElement *element);
+void reclaimRetiredElements(struct HazardRecord *record);
+bool isHazardous(struct LockFreeElement *element);
+struct HazardRecord *fetchHazardRecord(void);
+void createHazardRecordKey(void);
+void releaseHazardRecordOnExit(void *record);
+void initShardedQueue(struct Queue *queue, const struct QueueOptions *options);
+void destroyShardedQueue(struct Queue *queue);
+bool pushToLane(struct Queue *queue, void *data);
+bool popFromLanes(struct Queue *queue, void **dataPointer);
+size_t fetchThreadLane(struct Queue *queue);
+size_t countQueuedItems(struct Queue *queue);
+size_t fetchThreadNumber(void);
+size_t fetchThreadNode(void);
+size_t fetchNumaNodeCount(void);
+void discoverNumaTopology(void);
+void *allocateOnNumaNode(size_t size, size_t node);
+void initSpscRing(struct Queue *queue, size_t capacity);
+void destroySpscRing(struct Queue *queue);
+bool pushToSpscRing(struct Queue *queue, void *data);
+bool popFromSpscRing(struct Queue *queue, void **dataPointer);
+bool popAsSingleConsumer(struct Queue *queue, void **dataPointer);
+void initMpscList(struct Queue *queue);
+void destroyMpscList(struct Queue *queue);
+bool pushToMpscList(struct Queue *queue, void *data);
+void appendToMpscList(struct Queue *queue, struct MpscElement *element);
+bool popFromMpscList(struct Queue *queue, void **dataPointer);
+void linkMpscElement(struct MpscList *list, struct MpscElement *element);
+bool initSegmentQueue(struct Queue *queue, const struct QueueOptions *options);
+void destroySegmentQueue(struct Queue *queue);
+void formatSegment(struct Queue *queue);
+void recoverSegment(struct Queue *queue);
+struct SegmentRecord *fetchSegmentRecord(struct Queue *queue, uint64_t position);
+bool pushToSegment(struct Queue *queue, void *data);
+bool popFromSegment(struct Queue *queue, void **dataPointer);
+void syncSegment(struct Queue *queue);
+void sizeSegment(struct Queue *queue, const struct QueueOptions *options, size_t header_size);
+bool initSharedRegion(struct Queue *queue, const struct QueueOptions *options);
+bool openSharedRegion(struct Queue *queue, bool *retry);
+bool waitForSharedRegionSize(struct Queue *queue);
+void abandonSharedRegion(struct Queue *queue, bool created);
+void destroySharedRegion(struct Queue *queue);
+bool pushToSharedRegion(struct Queue *queue, void *data, const struct timespec *deadline);
+bool dequeueFromSharedRegion(struct Queue *queue, void **dataPointer, const struct timespec *deadline);
+bool waitOnSharedWord(_Atomic uint32_t *word, uint32_t expected, const struct timespec *deadline);
+void wakeSharedSleepers(_Atomic uint32_t *word, _Atomic uint32_t *sleepers, uint32_t count);
+void openReadinessDescriptor(struct Queue *queue, bool requested);
+void closeReadinessDescriptor(struct Queue *queue);
+void notifyReadiness(struct Queue *queue);
+void signalReadinessDescriptor(struct Queue *queue);
+bool rearmReadiness(struct Queue *queue);
+bool takeQueuedItem(struct Queue *queue, void **dataPointer);
+size_t takeQueuedItems(struct Queue *queue, void **items, size_t max_items);
+void lockDataQueue(struct Queue *queue);
+void asyncDequeueFromList(struct Queue *queue, void (*callback)(void *context, void *item), void *context);
+void asyncDequeueWithoutLock(struct Queue *queue, void (*callback)(void *context, void *item), void *context);
+struct QueueNode *createContinuationNode(struct Queue *queue, void (*callback)(void *context, void *item), void *context);
+void settleContinuation(struct Queue *queue, struct QueueNode *node);
+struct QueueNode *serveContinuations(struct Queue *queue);
+struct QueueNode *cancelContinuations(struct Queue *queue);
+struct QueueNode *passTurnToNextConsumer(struct Queue *queue);
+void runContinuations(struct Queue *queue, struct QueueNode *continuations);
+#ifdef QUEUE_STATS
+void resetStatCounters(struct Queue *queue);
+void addStatsOf(struct Queue *queue, struct QueueStats *snapshot);
+void recordDepth(struct Queue *queue, size_t depth);
+void recordTimeInQueue(struct Queue *queue, uint64_t enqueuedAt);
+void addToHistogram(struct LatencyHistogram *histogram, size_t bucket);
+uint64_t readStatsClock(void);
+uint64_t readFallbackClock(void);
+void calibrateStatsClock(void);
+#endif
+size_t fetchLatencyBucket(uint64_t nanoseconds);
+void addToCounter(struct StripedCounter *counter, unsigned long amount);
+unsigned long readCounter(struct StripedCounter *counter);
+void resetCounter(struct StripedCounter *counter);
 
 
 void initQueue(void)
 {
-    // Set pointers in the data queue to NULL, preparing for an empty queue state.
-    dataQueue.head = NULL;
-    dataQueue.tail = NULL;
-    // Initialize all counters in the data queue to 0 for a clear start.
-    dataQueue.total_size = 0;
-    dataQueue.items_processed = 0;
-    dataQueue.items_enqueued = 0;
-    // Prepare the mutex for future operations on the data queue.
-    mtx_init(&dataQueue.synchronization_lock, mtx_plain);
-    
-    // Set thread queue pointers to NULL, indicating absence of enqueued threads.
-    threadQueue.head = NULL;
-    threadQueue.tail = NULL;
-    // Initialize the count of threads in waiting to 0.
-    threadQueue.waiting_thread_count = 0;
+    struct QueueOptions defaultOptions = {0};
+    initQueueWithOptions(&defaultOptions);
+}
+
+bool initQueueWithOptions(const struct QueueOptions *options)
+{
+    return initQueueInstance(&defaultQueue, options);
 }
 
 void destroyQueue(void)
 {
-    // Obtain exclusive access to the data queue by locking it.
-    mtx_lock(&dataQueue.synchronization_lock);
-    // Perform a secure cleanup of data nodes.
-    removeAllDataElements();
-    // Methodically dismantle the thread queue.
-    teardownThreadQueue();
-    // Unlock the data queue after finishing cleanup activities.
-    mtx_unlock(&dataQueue.synchronization_lock);
-    // Dispose of the mutex as the data queue is no longer required.
-    mtx_destroy(&dataQueue.synchronization_lock);
+    destroyQueueInstance(&defaultQueue);
 }
 
-void removeAllDataElements(void)
+void enqueue(void *data)
 {
-    struct DataElement *current_element;
-    while (dataQueue.head != NULL)
-    {
-        current_element = dataQueue.head;
-        dataQueue.head = current_element->next;
-        free(current_element);
-    }
-    // Clear remaining fields to maintain a consistent state for the data queue.
-    dataQueue.tail = NULL;
-    dataQueue.total_size = 0;
-    dataQueue.items_processed = 0;
-    dataQueue.items_enqueued = 0;
+    queueEnqueue(&defaultQueue, data);
 }
 
-void teardownThreadQueue(void)
+void enqueuePriority(void *data, int priority)
 {
-    thrd_t current_thread = thrd_current();
-    while (threadQueue.head != NULL)
-    {
-        threadQueue.head->terminated = true;
-        cnd_signal(&threadQueue.head->sync_condition);
-        // Advance to the next node to prevent looping indefinitely.
-        threadQueue.head = threadQueue.head->successor;
-    }
-    // Restore the thread queue to an initial state after emptying it.
-    threadQueue.tail = NULL;
-    threadQueue.waiting_thread_count = 0;
+    queueEnqueuePriority(&defaultQueue, data, priority);
 }
 
-void enqueue(void *data)
+void enqueueIntrusive(struct QueueLink *link)
 {
-    mtx_lock(&dataQueue.synchronization_lock);
-    struct DataElement *new_element = createDataElement(data);
-    appendToDataQueue(new_element);
-    mtx_unlock(&dataQueue.synchronization_lock);
+    queueEnqueueIntrusive(&defaultQueue, link);
+}
 
-    if (dataQueue.total_size > 0 && threadQueue.waiting_thread_count > 0)
-    {
-        // Trigger the first thread in the queue if there are items and threads are waiting.
-        cnd_signal(&threadQueue.head->sync_condition);
-    }
+bool tryEnqueue(void *data)
+{
+    return queueTryEnqueue(&defaultQueue, data);
 }
 
-struct DataElement *createDataElement(void *data)
+bool enqueueTimed(void *data, const struct timespec *deadline)
 {
-    // Assume successful memory allocation as per the given context.
-    struct DataElement *element = (struct DataElement *)malloc(sizeof(struct DataElement));
-    element->pointer = data;
-    element->next = NULL;
-    element->index = dataQueue.items_enqueued;
-    return element;
+    return queueEnqueueTimed(&defaultQueue, data, deadline);
 }
 
-void addToDataQueue(struct DataElement *elementToAdd)
+void *dequeue(void)
 {
-    dataQueue.total_size == 0 ? appendToEmptyDataQueue(elementToAdd) : appendToPopulatedDataQueue(elementToAdd);
+    return queueDequeue(&defaultQueue);
 }
 
-void appendToEmptyDataQueue(struct DataElement *elementToAdd)
+bool dequeueTimed(void **dataPointer, const struct timespec *deadline)
 {
-    dataQueue.head = elementToAdd;
-    dataQueue.tail = elementToAdd;
-    dataQueue.total_size++;
-    dataQueue.items_enqueued++;
+    return queueDequeueTimed(&defaultQueue, dataPointer, deadline);
 }
 
-void appendToPopulatedDataQueue(struct DataElement *elementToAdd)
+bool tryDequeue(void **dataPointer)
 {
-    dataQueue.tail->next = elementToAdd;
-    dataQueue.tail = elementToAdd;
-    dataQueue.total_size++;
-    dataQueue.items_enqueued++;
+    return queueTryDequeue(&defaultQueue, dataPointer);
 }
 
-void *dequeue(void)
+void enqueueBatch(void **items, size_t count)
+{
+    queueEnqueueBatch(&defaultQueue, items, count);
+}
+
+size_t dequeueBatch(void **items, size_t max_items)
+{
+    return queueDequeueBatch(&defaultQueue, items, max_items);
+}
+
+size_t tryDequeueBatch(void **items, size_t max_items)
+{
+    return queueTryDequeueBatch(&defaultQueue, items, max_items);
+}
+
+size_t size(void)
 {
-    mtx_lock(&dataQueue.synchronization_lock);
-    // Thread waits if necessary as per the conditions
-    while (checkIfThreadShouldYield())
+    return queueSize(&defaultQueue);
+}
+
+size_t waiting(void)
+{
+    return queueWaiting(&defaultQueue);
+}
+
+size_t visited(void)
+{
+    return queueVisited(&defaultQueue);
+}
+
+void closeQueue(void)
+{
+    queueClose(&defaultQueue);
+}
+
+bool stats(struct QueueStats *snapshot)
+{
+    return queueStats(&defaultQueue, snapshot);
+}
+
+int notificationDescriptor(void)
+{
+    return queueNotificationDescriptor(&defaultQueue);
+}
+
+void asyncDequeue(void (*callback)(void *context, void *item), void *context)
+{
+    queueAsyncDequeue(&defaultQueue, callback, context);
+}
+
+struct Queue *queueCreate(const struct QueueOptions *options)
+{
+    return createQueueOnNode(options, fetchThreadNode());
+}
+
+struct Queue *createQueueOnNode(const struct QueueOptions *options, size_t node)
+{
+    // Assume successful memory allocation as per the given context.
+    struct Queue *queue = (struct Queue *)allocateOnNumaNode(sizeof(struct Queue), node);
+    struct QueueOptions defaultOptions = {0};
+    if (!initQueueInstance(queue, options == NULL ? &defaultOptions : options))
     {
-        enqueueQueueNode();
-        struct QueueNode *currentThreadNode = threadQueue.tail;
-        cnd_wait(&currentThreadNode->sync_condition, &dataQueue.synchronization_lock);
-        if (currentThreadNode->terminated)
-        {
-            struct QueueNode *previousHead;
-            previousHead = threadQueue.head;
-            threadQueue.head = previousHead->successor;
-            // To prevent orphan threads when the queue is being destroyed
-            free(previousHead);
-            thrd_join(current_thread, NULL);
-        }
-        if (dataQueue.head && fetchFirstWaitConditionStatus() <= dataQueue.head->index)
-        {
-            dequeueQueueNode();
-        }
+        free(queue);
+        return NULL;
     }
+    return queue;
+}
 
-    struct DataElement *elementRemoved = dataQueue.head;
-    dataQueue.head = elementRemoved->next;
-    if (dataQueue.head == NULL)
+void queueDestroy(struct Queue *queue)
+{
+    destroyQueueInstance(queue);
+    free(queue);
+}
+
+bool initQueueInstance(struct Queue *queue, const struct QueueOptions *options)
+{
+    // Set pointers in the data queue to NULL, preparing for an empty queue state.
+    queue->data.head = NULL;
+    queue->data.tail = NULL;
+    memset(queue->data.priority_tails, 0, sizeof(queue->data.priority_tails));
+    // Initialize all counters in the data queue to 0 for a clear start.
+    queue->data.total_size = 0;
+    resetCounter(&queue->data.items_processed);
+    resetCounter(&queue->data.items_enqueued);
+    RECORD_STAT(resetStatCounters(queue));
+    RECORD_STAT(call_once(&stats_clock_once, calibrateStatsClock));
+    // Prepare the mutex for future operations on the data queue.
+    mtx_init(&queue->data.synchronization_lock, mtx_plain);
+    queue->data.backend = options->backend;
+    queue->data.spin_limit = options->spin_limit;
+    queue->data.direct_hand_off = options->direct_hand_off;
+    queue->data.prefetch_next = options->prefetch_next;
+    queue->data.capacity = options->capacity;
+    atomic_init(&queue->data.closed, false);
+    atomic_init(&queue->data.destroyed, false);
+    resetCounter(&queue->occupants);
+    
+    // Consumers waiting for items and producers waiting for room each line up in their own thread queue.
+    initThreadQueue(&queue->threads);
+    initThreadQueue(&queue->producers);
+    call_once(&thread_waiter_key_once, createThreadWaiterKey);
+    // Pre-reserve data elements so that steady-state enqueues never reach the heap.
+    attachToElementPool(options->reserved_elements);
+    openReadinessDescriptor(queue, options->notification_descriptor);
+    bool ready = true;
+    if (queue->data.backend == QUEUE_BACKEND_RING)
     {
-        dataQueue.tail = NULL;
+        initRingQueue(queue, options->capacity);
     }
-    dataQueue.total_size--;
-    dataQueue.items_processed++;
-    mtx_unlock(&dataQueue.synchronization_lock);
-    void *data = elementRemoved->pointer;
-    free(elementRemoved);
-    return data;
+    else if (queue->data.backend == QUEUE_BACKEND_LOCK_FREE_LIST)
+    {
+        initLockFreeList(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        initShardedQueue(queue, options);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SPSC_RING)
+    {
+        initSpscRing(queue, options->capacity);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_MPSC_LIST)
+    {
+        initMpscList(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SEGMENT)
+    {
+        ready = initSegmentQueue(queue, options);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        ready = initSharedRegion(queue, options);
+    }
+    if (!ready)
+    {
+        // Undo the rest; the queue is left marked destroyed, so that calls on it return at once and destroying it again does nothing.
+        closeReadinessDescriptor(queue);
+        detachFromElementPool();
+        mtx_destroy(&queue->data.synchronization_lock);
+        atomic_store(&queue->data.destroyed, true);
+    }
+    return ready;
 }
 
-bool checkIfThreadShouldYield(void)
+void destroyQueueInstance(struct Queue *queue)
 {
-    if (dataQueue.total_size == 0)
+    // Nothing is left to tear down of a queue that failed to initialize or was destroyed already.
+    if (atomic_load(&queue->data.destroyed))
     {
-        return true;
+        return;
     }
-    if (threadQueue.waiting_thread_count <= dataQueue.total_size)
+    // Closing wakes every parked thread and turning later callers away keeps new ones out; wait until every thread inside a call has left,
+    // parked or spinning or still waking others after unlocking, so that none touches the queue after it is torn down.
+    queueClose(queue);
+    atomic_store(&queue->data.destroyed, true);
+    for (;;)
     {
-        return false;
+        unsigned long occupants = 0;
+        for (size_t i = 0; i < COUNTER_STRIPES; i++)
+        {
+            occupants += atomic_load(&queue->occupants.stripes[i].value);
+        }
+        if (occupants == 0)
+        {
+            break;
+        }
+        thrd_yield();
+    }
+    lockDataQueue(queue);
+    // Perform a secure cleanup of data nodes.
+    removeAllDataElements(queue);
+    // Unlock the data queue after finishing cleanup activities.
+    mtx_unlock(&queue->data.synchronization_lock);
+    // Dispose of the mutex as the data queue is no longer required.
+    mtx_destroy(&queue->data.synchronization_lock);
+    closeReadinessDescriptor(queue);
+    if (queue->data.backend == QUEUE_BACKEND_RING)
+    {
+        destroyRingQueue(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_LOCK_FREE_LIST)
+    {
+        destroyLockFreeList(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        destroyShardedQueue(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SPSC_RING)
+    {
+        destroySpscRing(queue);
     }
-    int statusOfFirstWaiting = fetchFirstWaitConditionStatus();
-    return statusOfFirstWaiting > dataQueue.head->index;
+    else if (queue->data.backend == QUEUE_BACKEND_MPSC_LIST)
+    {
+        destroyMpscList(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SEGMENT)
+    {
+        destroySegmentQueue(queue);
+    }
+    else if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        destroySharedRegion(queue);
+    }
+    // Release the pool's slabs if this was the last queue drawing from it, once the MPSC list has handed back the elements it drew.
+    detachFromElementPool();
+}
+
+bool enterQueue(struct Queue *queue)
+{
+    // The thread counts itself before looking at the flag and the destroyer sets the flag before counting, so that one of the two always sees the other.
+    atomic_fetch_add(&queue->occupants.stripes[fetchThreadNumber() % COUNTER_STRIPES].value, 1);
+    return !atomic_load(&queue->data.destroyed);
+}
+
+void leaveQueue(struct Queue *queue)
+{
+    // Released, so that the destroyer that finds the count at zero also finds everything the thread did to the queue finished.
+    atomic_fetch_sub_explicit(&queue->occupants.stripes[fetchThreadNumber() % COUNTER_STRIPES].value, 1, memory_order_release);
 }
 
-int fetchFirstWaitConditionStatus(void)
+void removeAllDataElements(struct Queue *queue)
 {
-    struct QueueNode *threadNodeChecker = threadQueue.head;
-    while (threadNodeChecker != NULL)
+    // Other queues may still be drawing from the pool, so hand the remaining elements back to it rather than dropping them; links stay with their owners.
+    if (queue->data.head != NULL)
     {
-        if (thrd_equal(thrd_current(), threadNodeChecker->thread_id))
+        struct ElementPool *pool = &elementPools[fetchThreadNode()];
+        mtx_lock(&pool->pool_lock);
+        struct DataElement *current_element = queue->data.head;
+        while (current_element != NULL)
         {
-            return threadNodeChecker->waiting_on_index;
+            struct DataElement *next_element = current_element->next;
+            if (!isQueueLink(current_element))
+            {
+                current_element->next = pool->free_list;
+                pool->free_list = current_element;
+                pool->free_count++;
+            }
+            current_element = next_element;
         }
-        threadNodeChecker = threadNodeChecker->successor;
+        mtx_unlock(&pool->pool_lock);
+    }
+    queue->data.head = NULL;
+    // Clear remaining fields to maintain a consistent state for the data queue.
+    queue->data.tail = NULL;
+    memset(queue->data.priority_tails, 0, sizeof(queue->data.priority_tails));
+    queue->data.total_size = 0;
+    resetCounter(&queue->data.items_processed);
+    resetCounter(&queue->data.items_enqueued);
+}
+
+void initThreadQueue(struct ThreadQueue *threadQueue)
+{
+    // Set thread queue pointers to NULL, indicating absence of enqueued threads.
+    threadQueue->head = NULL;
+    threadQueue->tail = NULL;
+    // Initialize the count of threads in waiting to 0.
+    threadQueue->waiting_thread_count = 0;
+    threadQueue->first_unclaimed = NULL;
+    threadQueue->claimed_count = 0;
+    atomic_init(&threadQueue->continuation_count, 0);
+}
+
+void queueClose(struct Queue *queue)
+{
+    if (enterQueue(queue))
+    {
+        closeAdmitted(queue);
     }
-    return -1;
+    leaveQueue(queue);
 }
 
-void enqueueQueueNode(void)
+void closeAdmitted(struct Queue *queue)
 {
-    struct QueueNode *newQueueNode = createThreadQueueNode();
-    appendToThreadQueue(newQueueNode);
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        for (size_t i = 0; i < queue->sharded.lane_count; i++)
+        {
+            queueClose(queue->sharded.lanes[i]);
+        }
+    }
+    lockDataQueue(queue);
+    atomic_store(&queue->data.closed, true);
+    // Continuations cannot be woken to find out, so they leave the line here, with whatever item is left for them.
+    struct QueueNode *continuations = cancelContinuations(queue);
+    // Waiters that were promised an item or a slot still complete; the others see the flag once woken and leave.
+    wakeAllWaiters(&queue->threads);
+    wakeAllWaiters(&queue->producers);
+    mtx_unlock(&queue->data.synchronization_lock);
+    runContinuations(queue, continuations);
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        // This process's sleepers share their words with every other process's, so all of them are woken and the others go back to sleep.
+        wakeSharedSleepers(&queue->segment.shared->item_signal, &queue->segment.shared->sleeping_consumers, INT32_MAX);
+        wakeSharedSleepers(&queue->segment.shared->room_signal, &queue->segment.shared->sleeping_producers, INT32_MAX);
+    }
+    // Event loops are woken too, whether or not a notification is pending, so that they find out without an item arriving.
+    if (queue->readiness.write_descriptor >= 0)
+    {
+        atomic_store(&queue->readiness.pending, true);
+        signalReadinessDescriptor(queue);
+    }
 }
 
-void dequeueQueueNode(void)
+void wakeAllWaiters(struct ThreadQueue *threadQueue)
 {
-    struct QueueNode *nodeBeingRemoved = threadQueue.head;
-    threadQueue.head = nodeBeingRemoved->successor;
-    free(nodeBeingRemoved);
-    if (threadQueue.head == NULL)
+    // Called with the lock held, which keeps every linked node alive, so the whole line is signalled in one pass without pending signals.
+    for (struct QueueNode *node = threadQueue->head; node != NULL; node = node->successor)
     {
-        threadQueue.tail = NULL;
+        signalQueueNode(node);
     }
-    threadQueue.waiting_thread_count--;
 }
 
-void appendToThreadQueue(struct QueueNode *nodeToAdd)
+void queueEnqueue(struct Queue *queue, void *data)
 {
-    threadQueue.waiting_thread_count == 0 ? appendToEmptyThreadQueue(nodeToAdd) : appendToPopulatedThreadQueue(nodeToAdd);
+    queueEnqueueTimed(queue, data, NULL);
 }
 
-void appendToEmptyThreadQueue(struct QueueNode *nodeToAdd)
+bool queueEnqueueTimed(struct Queue *queue, void *data, const struct timespec *deadline)
 {
-    threadQueue.head = nodeToAdd;
-    threadQueue.tail = nodeToAdd;
-    threadQueue.waiting_thread_count++;
+    bool enqueued = enterQueue(queue) && enqueueAdmitted(queue, data, deadline);
+    leaveQueue(queue);
+    return enqueued;
 }
 
-void appendToPopulatedThreadQueue(struct QueueNode *nodeToAdd)
+bool enqueueAdmitted(struct Queue *queue, void *data, const struct timespec *deadline)
 {
-    threadQueue.tail->successor = nodeToAdd;
-    threadQueue.tail = nodeToAdd;
-    threadQueue.waiting_thread_count++;
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        return enqueueWithoutLock(queue, data, deadline);
+    }
+    return enqueueToList(queue, data, 0, deadline, true, false);
 }
 
-struct QueueNode *createThreadQueueNode(void)
+void queueEnqueuePriority(struct Queue *queue, void *data, int priority)
 {
-    struct QueueNode *newQueueNode = (struct QueueNode *)malloc(sizeof(struct QueueNode));
-    newQueueNode->thread_id = thrd_current();
-    newQueueNode->successor = NULL;
-    newQueueNode->terminated = false;
-    cnd_init(&newQueueNode->sync_condition);
-    newQueueNode->waiting_on_index = dataQueue.items_enqueued + threadQueue.waiting_thread_count;
-    return newQueueNode;
+    if (enterQueue(queue))
+    {
+        enqueuePriorityAdmitted(queue, data, priority);
+    }
+    leaveQueue(queue);
 }
 
-bool tryDequeue(void **dataPointer)
+void enqueuePriorityAdmitted(struct Queue *queue, void *data, int priority)
 {
-    mtx_lock(&dataQueue.synchronization_lock);
-    if (dataQueue.total_size == 0 || dataQueue.head == NULL)
+    // Out-of-range priorities are clamped rather than rejected.
+    priority = priority < 0 ? 0 : priority >= QUEUE_PRIORITY_LEVELS ? QUEUE_PRIORITY_LEVELS - 1 : priority;
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
     {
-        mtx_unlock(&dataQueue.synchronization_lock);
-        return false;
+        // Priorities are honoured within the producer's lane.
+        queueEnqueuePriority(queue->sharded.lanes[fetchThreadLane(queue)], data, priority);
+        wakeHeadWaiterAfterPush(queue);
+        return;
     }
-    struct DataElement *elementBeingRemoved = dataQueue.head;
-    dataQueue.head = elementBeingRemoved->next;
-    if (dataQueue.head == NULL)
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
     {
-        dataQueue.tail = NULL;
+        // The lock-free backends have no way to let an item overtake others, so they keep it in plain FIFO order.
+        enqueueWithoutLock(queue, data, NULL);
+        return;
     }
-    dataQueue.total_size--;
-    dataQueue.items_processed++;
-    mtx_unlock(&dataQueue.synchronization_lock);
-    *dataPointer = elementBeingRemoved->pointer;
-    free(elementBeingRemoved);
-    return true;
+    enqueueToList(queue, data, priority, NULL, true, false);
 }
 
-size_t size(void)
+void queueEnqueueIntrusive(struct Queue *queue, struct QueueLink *link)
 {
-    return dataQueue.total_size;
+    if (enterQueue(queue))
+    {
+        enqueueIntrusiveAdmitted(queue, link);
+    }
+    leaveQueue(queue);
 }
 
-size_t waiting(void)
+void enqueueIntrusiveAdmitted(struct Queue *queue, struct QueueLink *link)
 {
-    return threadQueue.waiting_thread_count;
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        queueEnqueueIntrusive(queue->sharded.lanes[fetchThreadLane(queue)], link);
+        wakeHeadWaiterAfterPush(queue);
+        return;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_MPSC_LIST)
+    {
+        // The list never fills up, so the item is appended straight away, the link itself serving as its element.
+        if (queue->data.closed)
+        {
+            return;
+        }
+        struct MpscElement *element = (struct MpscElement *)(void *)link;
+        element->pointer = link;
+        appendToMpscList(queue, element);
+        wakeHeadWaiterAfterPush(queue);
+        return;
+    }
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        // The rings hold the pointer in a slot anyway, and the lock-free list needs an element it can retire.
+        enqueueWithoutLock(queue, link, NULL);
+        return;
+    }
+    enqueueToList(queue, link, 0, NULL, true, true);
 }
 
-size_t visited(void)
+bool queueTryEnqueue(struct Queue *queue, void *data)
 {
-    return dataQueue.items_processed;
+    bool enqueued = enterQueue(queue) && tryEnqueueAdmitted(queue, data);
+    leaveQueue(queue);
+    return enqueued;
+}
+
+bool tryEnqueueAdmitted(struct Queue *queue, void *data)
+{
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        // Room freed while producers are parked belongs to them.
+        if (queue->data.closed || queue->producers.waiting_thread_count > 0 || !pushWithoutLock(queue, data))
+        {
+            return false;
+        }
+        wakeHeadWaiterAfterPush(queue);
+        return true;
+    }
+    return enqueueToList(queue, data, 0, NULL, false, false);
+}
+
+bool enqueueToList(struct Queue *queue, void *data, int priority, const struct timespec *deadline, bool mayWait, bool intrusive)
+{
+    // Take the element from the thread cache before locking to keep the critical section short, unless the item brings its own or is meant to bypass the list.
+    struct DataElement *new_element = intrusive ? adoptQueueLink((struct QueueLink *)data) : queue->data.direct_hand_off ? NULL : createDataElement(data);
+    struct QueueNode *claimedNode = NULL;
+    struct QueueNode *producerNode = NULL;
+    lockDataQueue(queue);
+    if (queue->data.closed)
+    {
+        mtx_unlock(&queue->data.synchronization_lock);
+        if (new_element != NULL)
+        {
+            releaseDataElement(new_element);
+        }
+        return false;
+    }
+    if (queue->data.direct_hand_off)
+    {
+        // Give the item straight to the oldest waiter; an item that never enters the list needs no room in it either.
+        claimedNode = handOffToNextWaiter(queue, data);
+    }
+    if (claimedNode == NULL)
+    {
+        if (!waitForFreeSlot(queue, deadline, mayWait))
+        {
+            mtx_unlock(&queue->data.synchronization_lock);
+            if (new_element != NULL)
+            {
+                releaseDataElement(new_element);
+            }
+            return false;
+        }
+        struct DataElement *elementToAdd = new_element != NULL ? new_element : createDataElement(data);
+        elementToAdd->priority = priority;
+        appendToDataQueue(queue, elementToAdd);
+        // Decide under the lock which waiter the item goes to and hand it over, so that nobody else can take it or be woken for it.
+        claimedNode = bindNextWaiter(queue);
+        // The item handed over leaves its slot behind at once, which may be owed to a producer waiting for room.
+        producerNode = claimedNode != NULL ? claimFreedSlot(queue) : NULL;
+    }
+    if (claimedNode != NULL && claimedNode->continuation != NULL)
+    {
+        settleContinuation(queue, claimedNode);
+    }
+    mtx_unlock(&queue->data.synchronization_lock);
+
+    if (producerNode != NULL)
+    {
+        wakeReservedWaiter(producerNode);
+    }
+    if (claimedNode != NULL && claimedNode->continuation != NULL)
+    {
+        runContinuations(queue, claimedNode);
+    }
+    else if (claimedNode != NULL)
+    {
+        // Signalling after unlocking lets the woken thread get the lock without waiting for the producer to let go of it.
+        wakeReservedWaiter(claimedNode);
+    }
+    notifyReadiness(queue);
+    return true;
+}
+
+bool waitForFreeSlot(struct Queue *queue, const struct timespec *deadline, bool mayWait)
+{
+    // Mirrors waitForDataElement(): a free slot means no producer is left waiting, and a producer that parks leaves only once a consumer hands it a slot.
+    if (queue->data.capacity == 0 || countFreeSlots(queue) > 0)
+    {
+        return true;
+    }
+    if (!mayWait)
+    {
+        return false;
+    }
+    struct QueueNode *currentThreadNode = enqueueQueueNode(&queue->producers);
+    while (!currentThreadNode->claimed)
+    {
+        if (!waitOnThreadQueueNode(queue, currentThreadNode, deadline) && !currentThreadNode->claimed)
+        {
+            dequeueQueueNode(&queue->producers, currentThreadNode);
+            return false;
+        }
+        if (queue->data.closed && !currentThreadNode->claimed)
+        {
+            // The queue was closed before a consumer freed a slot for this producer.
+            dequeueQueueNode(&queue->producers, currentThreadNode);
+            return false;
+        }
+    }
+    // Leaving the line releases the promise, turning the slot into the one this thread fills.
+    dequeueQueueNode(&queue->producers, currentThreadNode);
+    return true;
+}
+
+size_t countFreeSlots(struct Queue *queue)
+{
+    // Slots promised to parked producers are as good as occupied.
+    return queue->data.capacity - queue->data.total_size - queue->producers.claimed_count;
+}
+
+struct QueueNode *claimFreedSlot(struct Queue *queue)
+{
+    // Called with the lock held after removing items: promise a freed slot to the oldest producer waiting for room.
+    if (queue->data.capacity == 0 || countFreeSlots(queue) == 0)
+    {
+        return NULL;
+    }
+    return claimNextWaiter(&queue->producers);
+}
+
+size_t claimFreedSlots(struct Queue *queue, struct QueueNode **nodesToWake)
+{
+    size_t wakeCount = 0;
+    struct QueueNode *producerNode;
+    while ((producerNode = claimFreedSlot(queue)) != NULL)
+    {
+        collectWaiterToWake(nodesToWake, &wakeCount, producerNode);
+    }
+    return wakeCount;
+}
+
+bool hasDeadlinePassed(const struct timespec *deadline)
+{
+    if (deadline == NULL)
+    {
+        return false;
+    }
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+
+struct DataElement *createDataElement(void *data)
+{
+    struct ElementCache *cache = fetchElementCache();
+    if (cache->head == NULL)
+    {
+        refillElementCache(cache);
+    }
+    struct DataElement *element = cache->head;
+    cache->head = element->next;
+    cache->count--;
+    element->pointer = data;
+    element->priority = 0;
+    element->next = NULL;
+    return element;
+}
+
+void releaseDataElement(struct DataElement *element)
+{
+    // A link goes back to the caller it came from along with the item.
+    if (isQueueLink(element))
+    {
+        return;
+    }
+    recycleDataElement(element);
+}
+
+void recycleDataElement(struct DataElement *element)
+{
+    struct ElementCache *cache = fetchElementCache();
+    element->next = cache->head;
+    cache->head = element;
+    cache->count++;
+    if (cache->count > ELEMENT_CACHE_CAPACITY)
+    {
+        // Hand a batch back so that consumer threads do not hoard what producer threads need.
+        flushElementCache(cache, ELEMENT_CACHE_BATCH);
+    }
+}
+
+struct DataElement *adoptQueueLink(struct QueueLink *link)
+{
+    // The element is laid over the link's storage and points at the link, which is what tells it apart from a pooled element and what the dequeue returns.
+    struct DataElement *element = (struct DataElement *)(void *)link;
+    element->pointer = link;
+    element->priority = 0;
+    element->next = NULL;
+    return element;
+}
+
+bool isQueueLink(struct DataElement *element)
+{
+    return element->pointer == (void *)element;
+}
+
+void attachToElementPool(size_t reserved_elements)
+{
+    call_once(&element_pool_once, createElementPool);
+    // Every node's pool serves every queue. Holding all of their locks keeps their generations in step, which is what lets a cache borrow from another node's pool.
+    lockElementPools();
+    if (elementPools[0].live_queue_count++ == 0)
+    {
+        // A fresh generation invalidates whatever thread caches still hold from slabs that have been released.
+        unsigned long generation = atomic_fetch_add(&pool_generation, 1) + 1;
+        for (size_t node = 0; node < ELEMENT_POOL_COUNT; node++)
+        {
+            elementPools[node].generation = generation;
+        }
+    }
+    if (reserved_elements > 0)
+    {
+        // The reserve goes to the creating thread's node, which is where its producers are most likely to run.
+        carveElementSlab(&elementPools[fetchThreadNode()], reserved_elements);
+    }
+    unlockElementPools();
+}
+
+void detachFromElementPool(void)
+{
+    lockElementPools();
+    if (--elementPools[0].live_queue_count == 0)
+    {
+        for (size_t node = 0; node < ELEMENT_POOL_COUNT; node++)
+        {
+            struct ElementPool *pool = &elementPools[node];
+            struct ElementSlab *current_slab;
+            while (pool->slabs != NULL)
+            {
+                current_slab = pool->slabs;
+                pool->slabs = current_slab->next;
+                free(current_slab);
+            }
+            pool->free_list = NULL;
+            pool->free_count = 0;
+            pool->generation = 0;
+        }
+    }
+    unlockElementPools();
+}
+
+void lockElementPools(void)
+{
+    // Always in ascending order; everyone else holds at most one pool lock at a time.
+    for (size_t node = 0; node < ELEMENT_POOL_COUNT; node++)
+    {
+        mtx_lock(&elementPools[node].pool_lock);
+    }
+}
+
+void unlockElementPools(void)
+{
+    for (size_t node = ELEMENT_POOL_COUNT; node > 0; node--)
+    {
+        mtx_unlock(&elementPools[node - 1].pool_lock);
+    }
+}
+
+void createElementPool(void)
+{
+    tss_create(&element_cache_key, returnElementCacheOnExit);
+    // The pool locks live as long as the process, so exiting threads can always flush their caches safely.
+    for (size_t node = 0; node < ELEMENT_POOL_COUNT; node++)
+    {
+        mtx_init(&elementPools[node].pool_lock, mtx_plain);
+    }
+}
+
+void carveElementSlab(struct ElementPool *pool, size_t element_count)
+{
+    // Assume successful memory allocation as per the given context.
+    struct ElementSlab *slab = (struct ElementSlab *)allocateOnNumaNode(sizeof(struct ElementSlab) + element_count * sizeof(struct DataElement), (size_t)(pool - elementPools));
+    slab->element_count = element_count;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    // Thread every element of the slab onto the shared free list.
+    for (size_t i = 0; i < element_count; i++)
+    {
+        slab->elements[i].next = pool->free_list;
+        pool->free_list = &slab->elements[i];
+    }
+    pool->free_count += element_count;
+}
+
+bool takeFromElementPool(struct ElementPool *pool, struct ElementCache *cache)
+{
+    // Move up to one batch from the shared free list into the thread cache; the caller holds the pool lock.
+    while (pool->free_list != NULL && cache->count < ELEMENT_CACHE_BATCH)
+    {
+        struct DataElement *element = pool->free_list;
+        pool->free_list = element->next;
+        pool->free_count--;
+        element->next = cache->head;
+        cache->head = element;
+        cache->count++;
+    }
+    return cache->count > 0;
+}
+
+void refillElementCache(struct ElementCache *cache)
+{
+    struct ElementPool *pool = cache->pool;
+    mtx_lock(&pool->pool_lock);
+    bool refilled = takeFromElementPool(pool, cache);
+    mtx_unlock(&pool->pool_lock);
+    // Elements released by consumers on other nodes pile up in those nodes' pools; taking them back before carving keeps the footprint bounded.
+    // Only one pool lock is ever held at a time, so threads on different nodes may borrow from each other freely.
+    for (size_t i = 1; i < fetchNumaNodeCount() && !refilled; i++)
+    {
+        struct ElementPool *remote_pool = &elementPools[(size_t)(pool - elementPools + i) % fetchNumaNodeCount()];
+        mtx_lock(&remote_pool->pool_lock);
+        refilled = takeFromElementPool(remote_pool, cache);
+        mtx_unlock(&remote_pool->pool_lock);
+    }
+    if (!refilled)
+    {
+        mtx_lock(&pool->pool_lock);
+        if (pool->free_count == 0)
+        {
+            carveElementSlab(pool, ELEMENT_SLAB_SIZE);
+        }
+        takeFromElementPool(pool, cache);
+        mtx_unlock(&pool->pool_lock);
+    }
+}
+
+void flushElementCache(struct ElementCache *cache, size_t element_count)
+{
+    struct ElementPool *pool = cache->pool;
+    mtx_lock(&pool->pool_lock);
+    if (cache->generation != pool->generation)
+    {
+        // Only give elements back if the slabs they came from are still alive.
+        cache->head = NULL;
+        cache->count = 0;
+        mtx_unlock(&pool->pool_lock);
+        return;
+    }
+    while (cache->head != NULL && element_count > 0)
+    {
+        struct DataElement *element = cache->head;
+        cache->head = element->next;
+        cache->count--;
+        element->next = pool->free_list;
+        pool->free_list = element;
+        pool->free_count++;
+        element_count--;
+    }
+    mtx_unlock(&pool->pool_lock);
+}
+
+struct ElementCache *fetchElementCache(void)
+{
+    struct ElementCache *cache = &element_cache;
+    if (cache->pool == NULL || cache->generation != cache->pool->generation)
+    {
+        // The cached elements belong to slabs that have since been released, so they must be forgotten, not reused.
+        cache->head = NULL;
+        cache->count = 0;
+        // The thread draws from, and gives back to, the pool of the node it first ran on.
+        cache->pool = &elementPools[fetchThreadNode()];
+        cache->generation = cache->pool->generation;
+        // Registering the cache arms the destructor that returns it to the pool when the thread exits.
+        tss_set(element_cache_key, cache);
+    }
+    return cache;
+}
+
+void returnElementCacheOnExit(void *cache)
+{
+    struct ElementCache *exitingCache = (struct ElementCache *)cache;
+    if (exitingCache->count > 0)
+    {
+        flushElementCache(exitingCache, exitingCache->count);
+    }
+}
+
+void appendToDataQueue(struct Queue *queue, struct DataElement *elementToAdd)
+{
+    // The lowest priority runs last in the list, so plain items are simply appended.
+    if (elementToAdd->priority > 0)
+    {
+        insertByPriority(queue, elementToAdd);
+        return;
+    }
+    queue->data.total_size == 0 ? appendToEmptyDataQueue(queue, elementToAdd) : appendToPopulatedDataQueue(queue, elementToAdd);
+    queue->data.priority_tails[0] = elementToAdd;
+}
+
+void appendToEmptyDataQueue(struct Queue *queue, struct DataElement *elementToAdd)
+{
+    queue->data.head = elementToAdd;
+    queue->data.tail = elementToAdd;
+    queue->data.total_size++;
+    addToCounter(&queue->data.items_enqueued, 1);
+    RECORD_STAT(elementToAdd->enqueued_at = readStatsClock());
+    RECORD_STAT(recordDepth(queue, queue->data.total_size));
+}
+
+void appendToPopulatedDataQueue(struct Queue *queue, struct DataElement *elementToAdd)
+{
+    queue->data.tail->next = elementToAdd;
+    queue->data.tail = elementToAdd;
+    queue->data.total_size++;
+    addToCounter(&queue->data.items_enqueued, 1);
+    RECORD_STAT(elementToAdd->enqueued_at = readStatsClock());
+    RECORD_STAT(recordDepth(queue, queue->data.total_size));
+}
+
+void insertByPriority(struct Queue *queue, struct DataElement *elementToAdd)
+{
+    // Link the element behind the last one of equal priority, or behind the nearest higher run, keeping FIFO order within each priority.
+    struct DataElement *predecessor = NULL;
+    for (int level = elementToAdd->priority; level < QUEUE_PRIORITY_LEVELS && predecessor == NULL; level++)
+    {
+        predecessor = queue->data.priority_tails[level];
+    }
+    if (predecessor == NULL)
+    {
+        elementToAdd->next = queue->data.head;
+        queue->data.head = elementToAdd;
+    }
+    else
+    {
+        elementToAdd->next = predecessor->next;
+        predecessor->next = elementToAdd;
+    }
+    if (elementToAdd->next == NULL)
+    {
+        queue->data.tail = elementToAdd;
+    }
+    queue->data.priority_tails[elementToAdd->priority] = elementToAdd;
+    queue->data.total_size++;
+    addToCounter(&queue->data.items_enqueued, 1);
+    RECORD_STAT(elementToAdd->enqueued_at = readStatsClock());
+    RECORD_STAT(recordDepth(queue, queue->data.total_size));
+}
+
+void appendChainToDataQueue(struct Queue *queue, struct DataElement *chainHead, struct DataElement *chainTail, size_t count)
+{
+    if (queue->data.total_size == 0)
+    {
+        queue->data.head = chainHead;
+    }
+    else
+    {
+        queue->data.tail->next = chainHead;
+    }
+    queue->data.tail = chainTail;
+    queue->data.priority_tails[0] = chainTail;
+    queue->data.total_size += count;
+    addToCounter(&queue->data.items_enqueued, count);
+    RECORD_STAT(recordDepth(queue, queue->data.total_size));
+}
+
+void *queueDequeue(struct Queue *queue)
+{
+    void *data = NULL;
+    queueDequeueTimed(queue, &data, NULL);
+    return data;
+}
+
+bool queueDequeueTimed(struct Queue *queue, void **dataPointer, const struct timespec *deadline)
+{
+    bool dequeued = enterQueue(queue) && dequeueAdmitted(queue, dataPointer, deadline);
+    leaveQueue(queue);
+    return dequeued;
+}
+
+bool dequeueAdmitted(struct Queue *queue, void **dataPointer, const struct timespec *deadline)
+{
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        return dequeueWithoutLock(queue, dataPointer, deadline);
+    }
+    // Give a short gap between items the chance to close before paying for a park and a wakeup.
+    spinUntilClaimable(queue);
+    lockDataQueue(queue);
+    if (!waitForDataElement(queue, deadline))
+    {
+        mtx_unlock(&queue->data.synchronization_lock);
+        return false;
+    }
+    if (takeHandedOffItem(dataPointer))
+    {
+        mtx_unlock(&queue->data.synchronization_lock);
+        return true;
+    }
+    struct DataElement *elementRemoved = detachDataElements(queue, 1);
+    struct QueueNode *producerNode = claimFreedSlot(queue);
+    mtx_unlock(&queue->data.synchronization_lock);
+    if (producerNode != NULL)
+    {
+        wakeReservedWaiter(producerNode);
+    }
+    *dataPointer = elementRemoved->pointer;
+    releaseDataElement(elementRemoved);
+    return true;
+}
+
+bool waitForDataElement(struct Queue *queue, const struct timespec *deadline)
+{
+    // A promised item leaves the list as it is promised, so whatever the list holds is free for the taking; while it holds any, no thread is left waiting unclaimed.
+    if (queue->data.total_size > 0)
+    {
+        return true;
+    }
+    // A closed queue gets no more items, so once it is drained consumers return instead of parking.
+    if (queue->data.closed)
+    {
+        return false;
+    }
+    struct QueueNode *currentThreadNode = enqueueQueueNode(&queue->threads);
+    RECORD_STAT(addToCounter(&queue->stats.parks, 1));
+    // Only the producer that picks this node can end the wait, so spurious wakeups simply go back to sleep.
+    while (!currentThreadNode->claimed)
+    {
+        if (!waitOnThreadQueueNode(queue, currentThreadNode, deadline) && !currentThreadNode->claimed)
+        {
+            // The deadline passed before any producer picked this thread, so no item is owed to it.
+            dequeueQueueNode(&queue->threads, currentThreadNode);
+            return false;
+        }
+        RECORD_STAT(addToCounter(&queue->stats.wakeups, 1));
+        RECORD_STAT(currentThreadNode->claimed ? (void)0 : addToCounter(&queue->stats.spurious_wakeups, 1));
+        if (queue->data.closed && !currentThreadNode->claimed)
+        {
+            dequeueQueueNode(&queue->threads, currentThreadNode);
+            return false;
+        }
+    }
+    // The item this thread was promised waits in its node, to be taken once it has left the line.
+    dequeueQueueNode(&queue->threads, currentThreadNode);
+    return true;
+}
+
+bool spinUntilClaimable(struct Queue *queue)
+{
+    // Items promised to parked threads have already left the list, so any item it holds is one this thread may take.
+    if (queue->data.spin_limit == 0 || queue->data.total_size > 0)
+    {
+        return true;
+    }
+    unsigned budget = fetchSpinBudget(queue);
+    for (unsigned i = 0; i < budget; i++)
+    {
+        relaxProcessor(i);
+        if (queue->data.total_size > 0 || queue->data.closed)
+        {
+            adaptSpinBudget(queue, true);
+            return true;
+        }
+    }
+    adaptSpinBudget(queue, false);
+    return false;
+}
+
+bool spinUntilPopped(struct Queue *queue, void **dataPointer)
+{
+    if (queue->data.spin_limit == 0)
+    {
+        return false;
+    }
+    unsigned budget = fetchSpinBudget(queue);
+    for (unsigned i = 0; i < budget; i++)
+    {
+        relaxProcessor(i);
+        // Stop competing as soon as someone parks, so that the oldest waiter keeps its priority, or once nothing more can arrive.
+        if (queue->threads.waiting_thread_count > 0 || queue->data.closed)
+        {
+            break;
+        }
+        if (popWithoutLock(queue, dataPointer))
+        {
+            adaptSpinBudget(queue, true);
+            return true;
+        }
+    }
+    adaptSpinBudget(queue, false);
+    return false;
+}
+
+unsigned fetchSpinBudget(struct Queue *queue)
+{
+    struct QueueNode *currentThreadNode = fetchThreadQueueNode();
+    // Start a fresh thread halfway, and keep the budget within the limit of the queue it is dequeuing from.
+    if (currentThreadNode->spin_budget == 0)
+    {
+        currentThreadNode->spin_budget = queue->data.spin_limit / 2 + 1;
+    }
+    if (currentThreadNode->spin_budget > queue->data.spin_limit)
+    {
+        currentThreadNode->spin_budget = queue->data.spin_limit;
+    }
+    return currentThreadNode->spin_budget;
+}
+
+void adaptSpinBudget(struct Queue *queue, bool spinPaidOff)
+{
+    struct QueueNode *currentThreadNode = fetchThreadQueueNode();
+    if (spinPaidOff)
+    {
+        unsigned grown = currentThreadNode->spin_budget * 2;
+        currentThreadNode->spin_budget = grown < queue->data.spin_limit ? grown : queue->data.spin_limit;
+    }
+    else
+    {
+        unsigned shrunk = currentThreadNode->spin_budget / 2;
+        currentThreadNode->spin_budget = shrunk > SPIN_BUDGET_FLOOR ? shrunk : SPIN_BUDGET_FLOOR;
+    }
+}
+
+void relaxProcessor(unsigned iteration)
+{
+    // Back off gently with the processor's spin-wait hint, and let other threads run every so often.
+    if (iteration % SPIN_POLLS_PER_YIELD == SPIN_POLLS_PER_YIELD - 1)
+    {
+        thrd_yield();
+        return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+bool waitOnThreadQueueNode(struct Queue *queue, struct QueueNode *node, const struct timespec *deadline)
+{
+    // Returns false only once the deadline has passed; a NULL deadline waits without limit.
+#ifdef PARK_ON_FUTEX
+    // Arming the word under the lock covers the gap between unlocking and sleeping, just as cnd_wait() does: a signal sent in it resets the word and the kernel
+    // then refuses to sleep, while one sent before the thread armed it finds the thread still holding the lock, about to see whatever the signal was for.
+    atomic_store_explicit(&node->parked, 1, memory_order_relaxed);
+    mtx_unlock(&queue->data.synchronization_lock);
+    // The absolute TIME_UTC deadline is handed to the kernel as is, as a CLOCK_REALTIME bitset wait.
+    long result = syscall(SYS_futex, &node->parked, FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME, 1, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    bool timedOut = result != 0 && errno == ETIMEDOUT;
+    atomic_store_explicit(&node->parked, 0, memory_order_relaxed);
+    lockDataQueue(queue);
+    return !timedOut;
+#else
+    if (deadline == NULL)
+    {
+        cnd_wait(&node->sync_condition, &queue->data.synchronization_lock);
+        return true;
+    }
+    return cnd_timedwait(&node->sync_condition, &queue->data.synchronization_lock, deadline) != thrd_timedout;
+#endif
+}
+
+void signalQueueNode(struct QueueNode *node)
+{
+#ifdef PARK_ON_FUTEX
+    // No lock is needed, and the system call is only made for a thread that is asleep or about to be.
+    if (atomic_exchange_explicit(&node->parked, 0, memory_order_acq_rel) == 1)
+    {
+        syscall(SYS_futex, &node->parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+#else
+    cnd_signal(&node->sync_condition);
+#endif
+}
+
+struct DataElement *detachDataElements(struct Queue *queue, size_t count)
+{
+    // Cut the first count elements off the data queue and return them as a NULL-terminated chain.
+    struct DataElement *chainHead = queue->data.head;
+    struct DataElement *chainTail = chainHead;
+    for (size_t i = 1; i <= count; i++)
+    {
+        RECORD_STAT(recordTimeInQueue(queue, chainTail->enqueued_at));
+        // A run is emptied once its last element leaves with the chain.
+        if (queue->data.priority_tails[chainTail->priority] == chainTail)
+        {
+            queue->data.priority_tails[chainTail->priority] = NULL;
+        }
+        if (i == count)
+        {
+            break;
+        }
+        chainTail = chainTail->next;
+    }
+    queue->data.head = chainTail->next;
+    chainTail->next = NULL;
+    if (queue->data.head == NULL)
+    {
+        queue->data.tail = NULL;
+    }
+    else if (queue->data.prefetch_next)
+    {
+        // The new head was prefetched by the previous dequeue, so reading it costs little; its payload is one dequeue ahead and its successor two.
+        PREFETCH(queue->data.head->next);
+        PREFETCH(queue->data.head->pointer);
+    }
+    queue->data.total_size -= count;
+    addToCounter(&queue->data.items_processed, count);
+    return chainHead;
+}
+
+struct QueueNode *claimNextWaiter(struct ThreadQueue *threadQueue)
+{
+    // Called with the lock held after freeing a slot: promise it to the oldest producer that has not been promised one yet.
+    struct QueueNode *claimedNode = threadQueue->first_unclaimed;
+    if (claimedNode == NULL)
+    {
+        return NULL;
+    }
+    claimedNode->claimed = true;
+    threadQueue->first_unclaimed = claimedNode->successor;
+    threadQueue->claimed_count++;
+    atomic_fetch_add_explicit(&claimedNode->pending_signals, 1, memory_order_relaxed);
+    return claimedNode;
+}
+
+struct QueueNode *bindNextWaiter(struct Queue *queue)
+{
+    // Called with the lock held after adding items: take the head item out for the oldest waiter that has not been promised one, as a hand-off would write it into the node.
+    // Waiters woken in any order then each take the item they were promised, not whichever heads the list by the time they get the lock.
+    struct QueueNode *claimedNode = queue->threads.first_unclaimed;
+    if (claimedNode == NULL)
+    {
+        return NULL;
+    }
+    struct DataElement *elementRemoved = detachDataElements(queue, 1);
+    claimedNode->claimed = true;
+    claimedNode->handed_off = true;
+    claimedNode->handed_off_pointer = elementRemoved->pointer;
+    queue->threads.first_unclaimed = claimedNode->successor;
+    atomic_fetch_add_explicit(&claimedNode->pending_signals, 1, memory_order_relaxed);
+    releaseDataElement(elementRemoved);
+    return claimedNode;
+}
+
+struct QueueNode *handOffToNextWaiter(struct Queue *queue, void *data)
+{
+    // Called with the lock held: write the item into the oldest unclaimed waiter, so that it never enters the data queue.
+    struct QueueNode *claimedNode = queue->threads.first_unclaimed;
+    if (claimedNode == NULL)
+    {
+        return NULL;
+    }
+    claimedNode->claimed = true;
+    claimedNode->handed_off = true;
+    claimedNode->handed_off_pointer = data;
+    queue->threads.first_unclaimed = claimedNode->successor;
+    // The item passes through the queue in one step, without ever adding to its size.
+    addToCounter(&queue->data.items_enqueued, 1);
+    addToCounter(&queue->data.items_processed, 1);
+    RECORD_STAT(addToHistogram(&queue->stats.time_in_queue, 0));
+    atomic_fetch_add_explicit(&claimedNode->pending_signals, 1, memory_order_relaxed);
+    return claimedNode;
+}
+
+bool takeHandedOffItem(void **dataPointer)
+{
+    // Consume the item a producer wrote into this thread's node during the last wait, if any.
+    struct QueueNode *currentThreadNode = fetchThreadQueueNode();
+    if (!currentThreadNode->handed_off)
+    {
+        return false;
+    }
+    *dataPointer = currentThreadNode->handed_off_pointer;
+    currentThreadNode->handed_off = false;
+    currentThreadNode->handed_off_pointer = NULL;
+    return true;
+}
+
+void collectWaiterToWake(struct QueueNode **nodesToWake, size_t *wakeCount, struct QueueNode *node)
+{
+    if (*wakeCount < QUEUE_WAKE_BATCH)
+    {
+        nodesToWake[(*wakeCount)++] = node;
+        return;
+    }
+    // More waiters than the wake list holds is rare enough that the overflow can be signalled in place.
+    wakeReservedWaiter(node);
+}
+
+struct QueueNode *reserveHeadWaiter(struct ThreadQueue *threadQueue)
+{
+    // Called with the lock held: pick the oldest waiter and keep its node alive until the signal has been delivered.
+    struct QueueNode *headNode = threadQueue->head;
+    if (headNode != NULL)
+    {
+        atomic_fetch_add_explicit(&headNode->pending_signals, 1, memory_order_relaxed);
+    }
+    return headNode;
+}
+
+void wakeReservedWaiter(struct QueueNode *node)
+{
+    // Called without the lock; the node may already have left the line, which only makes the signal spurious.
+    signalQueueNode(node);
+    atomic_fetch_sub_explicit(&node->pending_signals, 1, memory_order_release);
+}
+
+void wakeReservedWaiters(struct QueueNode **nodes, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        wakeReservedWaiter(nodes[i]);
+    }
+}
+
+struct QueueNode *enqueueQueueNode(struct ThreadQueue *threadQueue)
+{
+    struct QueueNode *newQueueNode = prepareThreadQueueNode();
+    appendToThreadQueue(threadQueue, newQueueNode);
+    return newQueueNode;
+}
+
+void dequeueQueueNode(struct ThreadQueue *threadQueue, struct QueueNode *nodeToRemove)
+{
+    // Splice the node out wherever it sits, since any eligible waiter may leave before those ahead of it have woken.
+    if (nodeToRemove->predecessor != NULL)
+    {
+        nodeToRemove->predecessor->successor = nodeToRemove->successor;
+    }
+    else
+    {
+        threadQueue->head = nodeToRemove->successor;
+    }
+    if (nodeToRemove->successor != NULL)
+    {
+        nodeToRemove->successor->predecessor = nodeToRemove->predecessor;
+    }
+    else
+    {
+        threadQueue->tail = nodeToRemove->predecessor;
+    }
+    if (threadQueue->first_unclaimed == nodeToRemove)
+    {
+        threadQueue->first_unclaimed = nodeToRemove->successor;
+    }
+    if (nodeToRemove->claimed && !nodeToRemove->handed_off)
+    {
+        // The slot promised to this producer is now being filled by it.
+        threadQueue->claimed_count--;
+    }
+    nodeToRemove->successor = NULL;
+    nodeToRemove->predecessor = NULL;
+    nodeToRemove->linked = false;
+    nodeToRemove->claimed = false;
+    threadQueue->waiting_thread_count--;
+}
+
+void appendToThreadQueue(struct ThreadQueue *threadQueue, struct QueueNode *nodeToAdd)
+{
+    threadQueue->waiting_thread_count == 0 ? appendToEmptyThreadQueue(threadQueue, nodeToAdd) : appendToPopulatedThreadQueue(threadQueue, nodeToAdd);
+}
+
+void appendToEmptyThreadQueue(struct ThreadQueue *threadQueue, struct QueueNode *nodeToAdd)
+{
+    nodeToAdd->predecessor = NULL;
+    threadQueue->head = nodeToAdd;
+    threadQueue->tail = nodeToAdd;
+    threadQueue->first_unclaimed = nodeToAdd;
+    threadQueue->waiting_thread_count++;
+}
+
+void appendToPopulatedThreadQueue(struct ThreadQueue *threadQueue, struct QueueNode *nodeToAdd)
+{
+    nodeToAdd->predecessor = threadQueue->tail;
+    threadQueue->tail->successor = nodeToAdd;
+    threadQueue->tail = nodeToAdd;
+    if (threadQueue->first_unclaimed == NULL)
+    {
+        threadQueue->first_unclaimed = nodeToAdd;
+    }
+    threadQueue->waiting_thread_count++;
+}
+
+struct QueueNode *prepareThreadQueueNode(void)
+{
+    struct QueueNode *newQueueNode = fetchThreadQueueNode();
+    newQueueNode->successor = NULL;
+    newQueueNode->linked = true;
+    newQueueNode->claimed = false;
+    return newQueueNode;
+}
+
+struct QueueNode *fetchThreadQueueNode(void)
+{
+    if (!thread_waiter_ready)
+    {
+        // The condition variable is initialized once per thread and reused for every subsequent wait.
+        thread_waiter.thread_id = thrd_current();
+        thread_waiter.successor = NULL;
+        thread_waiter.predecessor = NULL;
+        thread_waiter.linked = false;
+        thread_waiter.claimed = false;
+        thread_waiter.handed_off = false;
+        thread_waiter.handed_off_pointer = NULL;
+        atomic_init(&thread_waiter.pending_signals, 0);
+        thread_waiter.spin_budget = 0;
+        thread_waiter.continuation = NULL;
+        thread_waiter.continuation_context = NULL;
+#ifdef PARK_ON_FUTEX
+        atomic_init(&thread_waiter.parked, 0);
+#else
+        cnd_init(&thread_waiter.sync_condition);
+#endif
+        // Registering the node arms the destructor that releases the condition variable when the thread exits.
+        tss_set(thread_waiter_key, &thread_waiter);
+        thread_waiter_ready = true;
+    }
+    return &thread_waiter;
+}
+
+void createThreadWaiterKey(void)
+{
+    tss_create(&thread_waiter_key, destroyThreadQueueNodeOnExit);
+}
+
+void destroyThreadQueueNodeOnExit(void *node)
+{
+    struct QueueNode *exitingNode = (struct QueueNode *)node;
+    // A producer that picked this node may still be about to signal it, so wait until it is done with it.
+    while (atomic_load_explicit(&exitingNode->pending_signals, memory_order_acquire) > 0)
+    {
+        thrd_yield();
+    }
+    // A futex word needs no teardown.
+#ifndef PARK_ON_FUTEX
+    cnd_destroy(&exitingNode->sync_condition);
+#endif
+}
+
+bool queueTryDequeue(struct Queue *queue, void **dataPointer)
+{
+    bool dequeued = enterQueue(queue) && tryDequeueAdmitted(queue, dataPointer);
+    leaveQueue(queue);
+    return dequeued;
+}
+
+bool tryDequeueAdmitted(struct Queue *queue, void **dataPointer)
+{
+    // Finding the queue empty rearms the readiness descriptor, after which an item that slipped in meanwhile is looked for once more.
+    return takeQueuedItem(queue, dataPointer) || (rearmReadiness(queue) && takeQueuedItem(queue, dataPointer));
+}
+
+bool takeQueuedItem(struct Queue *queue, void **dataPointer)
+{
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        if (!popWithoutLock(queue, dataPointer))
+        {
+            return false;
+        }
+        wakeHeadProducerAfterPop(queue);
+        return true;
+    }
+    lockDataQueue(queue);
+    if (queue->data.total_size == 0)
+    {
+        mtx_unlock(&queue->data.synchronization_lock);
+        return false;
+    }
+    struct DataElement *elementBeingRemoved = detachDataElements(queue, 1);
+    struct QueueNode *producerNode = claimFreedSlot(queue);
+    mtx_unlock(&queue->data.synchronization_lock);
+    if (producerNode != NULL)
+    {
+        wakeReservedWaiter(producerNode);
+    }
+    *dataPointer = elementBeingRemoved->pointer;
+    releaseDataElement(elementBeingRemoved);
+    return true;
+}
+
+void queueEnqueueBatch(struct Queue *queue, void **items, size_t count)
+{
+    if (enterQueue(queue))
+    {
+        enqueueBatchAdmitted(queue, items, count);
+    }
+    leaveQueue(queue);
+}
+
+void enqueueBatchAdmitted(struct Queue *queue, void **items, size_t count)
+{
+    if (count == 0 || queue->data.closed)
+    {
+        return;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        // The whole batch goes to the producer's own lane in a single splice.
+        queueEnqueueBatch(queue->sharded.lanes[fetchThreadLane(queue)], items, count);
+        wakeHeadWaiterAfterPush(queue);
+        return;
+    }
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        enqueueBatchWithoutLock(queue, items, count);
+        return;
+    }
+    if (queue->data.capacity != 0)
+    {
+        // A bounded list may only have room for part of the batch, so each item waits for its own slot.
+        for (size_t i = 0; i < count; i++)
+        {
+            enqueueToList(queue, items[i], 0, NULL, true, false);
+        }
+        return;
+    }
+    if (queue->data.direct_hand_off)
+    {
+        enqueueBatchByHandOff(queue, items, count);
+        return;
+    }
+    // Link and stamp the whole chain before locking, so the critical section is a single splice.
+    struct DataElement *chainHead = createDataElement(items[0]);
+    struct DataElement *chainTail = chainHead;
+    RECORD_STAT(chainHead->enqueued_at = readStatsClock());
+    for (size_t i = 1; i < count; i++)
+    {
+        chainTail->next = createDataElement(items[i]);
+        chainTail = chainTail->next;
+        RECORD_STAT(chainTail->enqueued_at = readStatsClock());
+    }
+    struct QueueNode *claimedNodes[QUEUE_WAKE_BATCH];
+    size_t claimedCount = 0;
+    struct QueueNode *continuations = NULL;
+    struct QueueNode **continuationsTail = &continuations;
+    lockDataQueue(queue);
+    appendChainToDataQueue(queue, chainHead, chainTail, count);
+    // Hand one item to each waiter in line order, up to the number of items made available.
+    for (size_t i = 0; i < count; i++)
+    {
+        struct QueueNode *claimedNode = bindNextWaiter(queue);
+        if (claimedNode == NULL)
+        {
+            break;
+        }
+        if (claimedNode->continuation != NULL)
+        {
+            // Settled continuations leave the line, and are chained in their order through the link that held them in it.
+            settleContinuation(queue, claimedNode);
+            *continuationsTail = claimedNode;
+            continuationsTail = &claimedNode->successor;
+            continue;
+        }
+        collectWaiterToWake(claimedNodes, &claimedCount, claimedNode);
+    }
+    mtx_unlock(&queue->data.synchronization_lock);
+    wakeReservedWaiters(claimedNodes, claimedCount);
+    runContinuations(queue, continuations);
+    notifyReadiness(queue);
+}
+
+void enqueueBatchByHandOff(struct Queue *queue, void **items, size_t count)
+{
+    struct QueueNode *claimedNodes[QUEUE_WAKE_BATCH];
+    size_t claimedCount = 0;
+    struct QueueNode *continuations = NULL;
+    struct QueueNode **continuationsTail = &continuations;
+    size_t handedOff = 0;
+    lockDataQueue(queue);
+    // Serve the waiters in order first; whatever is left once nobody is waiting goes into the data queue.
+    for (; handedOff < count; handedOff++)
+    {
+        struct QueueNode *claimedNode = handOffToNextWaiter(queue, items[handedOff]);
+        if (claimedNode == NULL)
+        {
+            break;
+        }
+        if (claimedNode->continuation != NULL)
+        {
+            settleContinuation(queue, claimedNode);
+            *continuationsTail = claimedNode;
+            continuationsTail = &claimedNode->successor;
+            continue;
+        }
+        collectWaiterToWake(claimedNodes, &claimedCount, claimedNode);
+    }
+    for (size_t i = handedOff; i < count; i++)
+    {
+        appendToDataQueue(queue, createDataElement(items[i]));
+    }
+    mtx_unlock(&queue->data.synchronization_lock);
+    wakeReservedWaiters(claimedNodes, claimedCount);
+    runContinuations(queue, continuations);
+    // Items nobody was waiting for are queued, which an event loop has to learn of as well.
+    if (handedOff < count)
+    {
+        notifyReadiness(queue);
+    }
+}
+
+size_t queueDequeueBatch(struct Queue *queue, void **items, size_t max_items)
+{
+    size_t count = enterQueue(queue) ? dequeueBatchAdmitted(queue, items, max_items) : 0;
+    leaveQueue(queue);
+    return count;
+}
+
+size_t dequeueBatchAdmitted(struct Queue *queue, void **items, size_t max_items)
+{
+    if (max_items == 0)
+    {
+        return 0;
+    }
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        if (!dequeueWithoutLock(queue, &items[0], NULL))
+        {
+            return 0;
+        }
+        // Extra items are only taken while nobody is parked, so waiters keep their FIFO priority.
+        return queue->threads.waiting_thread_count == 0 ? 1 + takeQueuedItems(queue, items + 1, max_items - 1) : 1;
+    }
+    lockDataQueue(queue);
+    if (!waitForDataElement(queue, NULL))
+    {
+        mtx_unlock(&queue->data.synchronization_lock);
+        return 0;
+    }
+    // A handed-off item fills the first slot by itself; any others come from the data queue.
+    size_t handedOff = takeHandedOffItem(&items[0]) ? 1 : 0;
+    // Beyond the first item, take what the list holds, none of which any waiter has been promised.
+    size_t queued = queue->data.total_size;
+    size_t count = max_items - handedOff < queued ? max_items - handedOff : queued;
+    struct DataElement *chain = count > 0 ? detachDataElements(queue, count) : NULL;
+    struct QueueNode *producerNodes[QUEUE_WAKE_BATCH];
+    size_t producerCount = claimFreedSlots(queue, producerNodes);
+    mtx_unlock(&queue->data.synchronization_lock);
+    wakeReservedWaiters(producerNodes, producerCount);
+    for (size_t i = handedOff; i < handedOff + count; i++)
+    {
+        struct DataElement *elementRemoved = chain;
+        chain = chain->next;
+        items[i] = elementRemoved->pointer;
+        releaseDataElement(elementRemoved);
+    }
+    return handedOff + count;
+}
+
+size_t queueTryDequeueBatch(struct Queue *queue, void **items, size_t max_items)
+{
+    size_t count = enterQueue(queue) ? tryDequeueBatchAdmitted(queue, items, max_items) : 0;
+    leaveQueue(queue);
+    return count;
+}
+
+size_t tryDequeueBatchAdmitted(struct Queue *queue, void **items, size_t max_items)
+{
+    size_t count = takeQueuedItems(queue, items, max_items);
+    if (count < max_items && rearmReadiness(queue))
+    {
+        count += takeQueuedItems(queue, items + count, max_items - count);
+    }
+    return count;
+}
+
+size_t takeQueuedItems(struct Queue *queue, void **items, size_t max_items)
+{
+    size_t count = 0;
+    if (queue->data.backend != QUEUE_BACKEND_LIST)
+    {
+        while (count < max_items && popWithoutLock(queue, &items[count]))
+        {
+            count++;
+        }
+        if (count > 0)
+        {
+            wakeHeadProducerAfterPop(queue);
+        }
+        return count;
+    }
+    lockDataQueue(queue);
+    count = queue->data.total_size < max_items ? queue->data.total_size : max_items;
+    struct DataElement *chain = count > 0 ? detachDataElements(queue, count) : NULL;
+    struct QueueNode *producerNodes[QUEUE_WAKE_BATCH];
+    size_t producerCount = claimFreedSlots(queue, producerNodes);
+    mtx_unlock(&queue->data.synchronization_lock);
+    wakeReservedWaiters(producerNodes, producerCount);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct DataElement *elementRemoved = chain;
+        chain = chain->next;
+        items[i] = elementRemoved->pointer;
+        releaseDataElement(elementRemoved);
+    }
+    return count;
+}
+
+void queueAsyncDequeue(struct Queue *queue, void (*callback)(void *context, void *item), void *context)
+{
+    bool admitted = enterQueue(queue);
+    if (admitted)
+    {
+        asyncDequeueAdmitted(queue, callback, context);
+    }
+    leaveQueue(queue);
+    // A destroyed queue has nothing left for the continuation, as a closed and drained one would not.
+    if (!admitted)
+    {
+        callback(context, NULL);
+    }
+}
+
+void asyncDequeueAdmitted(struct Queue *queue, void (*callback)(void *context, void *item), void *context)
+{
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        // Producers in other processes could never run a continuation of this one, so the calling thread waits for its item itself.
+        callback(context, queueDequeue(queue));
+        return;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_LIST)
+    {
+        asyncDequeueFromList(queue, callback, context);
+        return;
+    }
+    asyncDequeueWithoutLock(queue, callback, context);
+}
+
+void asyncDequeueFromList(struct Queue *queue, void (*callback)(void *context, void *item), void *context)
+{
+    lockDataQueue(queue);
+    // Mirrors waitForDataElement(): a queued item is taken at once, and otherwise the continuation lines up to be promised one.
+    if (queue->data.total_size > 0)
+    {
+        struct DataElement *elementRemoved = detachDataElements(queue, 1);
+        struct QueueNode *producerNode = claimFreedSlot(queue);
+        mtx_unlock(&queue->data.synchronization_lock);
+        if (producerNode != NULL)
+        {
+            wakeReservedWaiter(producerNode);
+        }
+        void *data = elementRemoved->pointer;
+        releaseDataElement(elementRemoved);
+        callback(context, data);
+        return;
+    }
+    if (queue->data.closed)
+    {
+        mtx_unlock(&queue->data.synchronization_lock);
+        callback(context, NULL);
+        return;
+    }
+    appendToThreadQueue(&queue->threads, createContinuationNode(queue, callback, context));
+    mtx_unlock(&queue->data.synchronization_lock);
+}
+
+void asyncDequeueWithoutLock(struct Queue *queue, void (*callback)(void *context, void *item), void *context)
+{
+    void *data = NULL;
+    // Only take the lock-free path while nobody is lined up, so those lined up keep their FIFO priority.
+    if (queue->threads.waiting_thread_count == 0 && popWithoutLock(queue, &data))
+    {
+        wakeHeadProducerAfterPop(queue);
+        callback(context, data);
+        return;
+    }
+    lockDataQueue(queue);
+    if (queue->data.closed)
+    {
+        bool popped = popWithoutLock(queue, &data);
+        mtx_unlock(&queue->data.synchronization_lock);
+        if (popped)
+        {
+            wakeHeadProducerAfterPop(queue);
+        }
+        callback(context, data);
+        return;
+    }
+    appendToThreadQueue(&queue->threads, createContinuationNode(queue, callback, context));
+    // Pairs with the fence in wakeHeadWaiterAfterPush(): either the producer sees the continuation or it is served here, should it already be at the head.
+    atomic_thread_fence(memory_order_seq_cst);
+    struct QueueNode *continuations = serveContinuations(queue);
+    mtx_unlock(&queue->data.synchronization_lock);
+    runContinuations(queue, continuations);
+}
+
+struct QueueNode *createContinuationNode(struct Queue *queue, void (*callback)(void *context, void *item), void *context)
+{
+    // Counted until it has run, which makes the one consumer of the single-consumer backends take turns with whoever pops for it, and with itself once it runs.
+    atomic_fetch_add_explicit(&queue->threads.continuation_count, 1, memory_order_relaxed);
+    // Only a continuation that has to line up costs an allocation, made under the lock like the wait it stands in for.
+    // Assume successful memory allocation as per the given context.
+    struct QueueNode *node = (struct QueueNode *)malloc(sizeof(struct QueueNode));
+    node->successor = NULL;
+    node->predecessor = NULL;
+    node->linked = true;
+    node->claimed = false;
+    node->handed_off = false;
+    node->handed_off_pointer = NULL;
+    atomic_init(&node->pending_signals, 0);
+    node->spin_budget = 0;
+    node->continuation = callback;
+    node->continuation_context = context;
+    return node;
+}
+
+void settleContinuation(struct Queue *queue, struct QueueNode *node)
+{
+    // Called with the lock held on a continuation a producer of the list backend just picked and handed its item: nobody will come for it, so it leaves the line at once.
+    dequeueQueueNode(&queue->threads, node);
+}
+
+struct QueueNode *serveContinuations(struct Queue *queue)
+{
+    // Called with the lock held: only the head of the line may take an item, so while a continuation heads it, it is given the next one and leaves.
+    // The continuations served are chained in their order through the link that held them in the line, to be run once the lock is released.
+    struct QueueNode *continuations = NULL;
+    struct QueueNode **continuationsTail = &continuations;
+    struct QueueNode *headNode;
+    while ((headNode = queue->threads.head) != NULL && headNode->continuation != NULL && popWithoutLock(queue, &headNode->handed_off_pointer))
+    {
+        dequeueQueueNode(&queue->threads, headNode);
+        *continuationsTail = headNode;
+        continuationsTail = &headNode->successor;
+    }
+    return continuations;
+}
+
+struct QueueNode *cancelContinuations(struct Queue *queue)
+{
+    // Called with the lock held while closing: every continuation leaves the line with an item if one is left that it may take, and with NULL otherwise.
+    // On the list backend no item is ever left unclaimed while a continuation waits, so only the lock-free backends look for one.
+    struct QueueNode *continuations = NULL;
+    struct QueueNode **continuationsTail = &continuations;
+    struct QueueNode *node = queue->threads.head;
+    while (node != NULL)
+    {
+        struct QueueNode *nextNode = node->successor;
+        if (node->continuation != NULL)
+        {
+            dequeueQueueNode(&queue->threads, node);
+            if (queue->data.backend == QUEUE_BACKEND_LIST || !popWithoutLock(queue, &node->handed_off_pointer))
+            {
+                node->handed_off_pointer = NULL;
+            }
+            *continuationsTail = node;
+            continuationsTail = &node->successor;
+        }
+        node = nextNode;
+    }
+    return continuations;
+}
+
+struct QueueNode *passTurnToNextConsumer(struct Queue *queue)
+{
+    // Called with the lock held by a consumer leaving the line of a lock-free backend: continuations now at its head are served, and a thread after them is signalled.
+    struct QueueNode *continuations = serveContinuations(queue);
+    if (countQueuedItems(queue) > 0 && queue->threads.head != NULL && queue->threads.head->continuation == NULL)
+    {
+        signalQueueNode(queue->threads.head);
+    }
+    return continuations;
+}
+
+void runContinuations(struct Queue *queue, struct QueueNode *continuations)
+{
+    // Called without the lock, so that a continuation may use the queue itself, even to line up again.
+    if (continuations != NULL)
+    {
+        // The items taken out on the continuations' behalf may have made room on a ring.
+        wakeHeadProducerAfterPop(queue);
+    }
+    while (continuations != NULL)
+    {
+        struct QueueNode *nextNode = continuations->successor;
+        continuations->continuation(continuations->continuation_context, continuations->handed_off_pointer);
+        free(continuations);
+        // Pairs with the acquire load in popAsSingleConsumer(): a consumer that finds no continuation left sees every pop made on their behalf.
+        atomic_fetch_sub_explicit(&queue->threads.continuation_count, 1, memory_order_release);
+        continuations = nextNode;
+    }
+}
+
+void initRingQueue(struct Queue *queue, size_t capacity)
+{
+    // Round the capacity up to a power of two so that positions map onto slots with a mask.
+    size_t slot_count = 2;
+    while (slot_count < (capacity == 0 ? RING_DEFAULT_CAPACITY : capacity))
+    {
+        slot_count <<= 1;
+    }
+    // Assume successful memory allocation as per the given context.
+    queue->ring.cells = (struct RingCell *)malloc(slot_count * sizeof(struct RingCell));
+    queue->ring.mask = slot_count - 1;
+    for (size_t i = 0; i < slot_count; i++)
+    {
+        atomic_init(&queue->ring.cells[i].sequence, i);
+        queue->ring.cells[i].pointer = NULL;
+    }
+    atomic_init(&queue->ring.enqueue_position, 0);
+    atomic_init(&queue->ring.dequeue_position, 0);
+}
+
+void destroyRingQueue(struct Queue *queue)
+{
+    free(queue->ring.cells);
+    queue->ring.cells = NULL;
+    queue->ring.mask = 0;
+}
+
+bool pushToRing(struct Queue *queue, void *data)
+{
+    struct RingCell *cell;
+    size_t position = atomic_load_explicit(&queue->ring.enqueue_position, memory_order_relaxed);
+    for (;;)
+    {
+        cell = &queue->ring.cells[position & queue->ring.mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0)
+        {
+            // The slot is free for this lap; claim it by advancing the shared position.
+            if (atomic_compare_exchange_weak_explicit(&queue->ring.enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // The slot still holds an item from the previous lap, so the ring is full.
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->ring.enqueue_position, memory_order_relaxed);
+        }
+    }
+    cell->pointer = data;
+    RECORD_STAT(cell->enqueued_at = readStatsClock());
+    // Count the item before publishing it so that the derived size never lags behind a consumer that already took it.
+    addToCounter(&queue->data.items_enqueued, 1);
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+    RECORD_STAT(recordDepth(queue, countQueuedItems(queue)));
+    return true;
+}
+
+bool popFromRing(struct Queue *queue, void **dataPointer)
+{
+    struct RingCell *cell;
+    size_t position = atomic_load_explicit(&queue->ring.dequeue_position, memory_order_relaxed);
+    for (;;)
+    {
+        cell = &queue->ring.cells[position & queue->ring.mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->ring.dequeue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // No producer has published this slot yet, so the ring is empty.
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->ring.dequeue_position, memory_order_relaxed);
+        }
+    }
+    *dataPointer = cell->pointer;
+    RECORD_STAT(recordTimeInQueue(queue, cell->enqueued_at));
+    addToCounter(&queue->data.items_processed, 1);
+    // Hand the slot back to producers for the next lap around the ring.
+    atomic_store_explicit(&cell->sequence, position + queue->ring.mask + 1, memory_order_release);
+    return true;
+}
+
+bool enqueueWithoutLock(struct Queue *queue, void *data, const struct timespec *deadline)
+{
+    if (!pushInTurn(queue, data, deadline))
+    {
+        return false;
+    }
+    wakeHeadWaiterAfterPush(queue);
+    return true;
+}
+
+bool pushInTurn(struct Queue *queue, void *data, const struct timespec *deadline)
+{
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        // Producers of other processes never join this line, so blocked producers sleep on the region instead.
+        return pushToSharedRegion(queue, data, deadline);
+    }
+    if (queue->data.closed)
+    {
+        return false;
+    }
+    // Only take the lock-free path while no producer is parked, so blocked producers keep their FIFO order.
+    if (queue->producers.waiting_thread_count == 0 && pushWithoutLock(queue, data))
+    {
+        return true;
+    }
+    // The ring is full: park like a consumer on an empty queue, with only the oldest producer allowed to push.
+    lockDataQueue(queue);
+    struct QueueNode *currentThreadNode = enqueueQueueNode(&queue->producers);
+    // Pairs with the fence in wakeHeadProducerAfterPop(): either this producer sees the freed slot or the consumer sees the parked producer.
+    atomic_thread_fence(memory_order_seq_cst);
+    while (queue->producers.head != currentThreadNode || !pushWithoutLock(queue, data))
+    {
+        if (!waitOnThreadQueueNode(queue, currentThreadNode, deadline))
+        {
+            if (queue->producers.head == currentThreadNode && pushWithoutLock(queue, data))
+            {
+                break;
+            }
+            dequeueQueueNode(&queue->producers, currentThreadNode);
+            passTurnToNextProducer(queue);
+            mtx_unlock(&queue->data.synchronization_lock);
+            return false;
+        }
+        if (queue->data.closed)
+        {
+            dequeueQueueNode(&queue->producers, currentThreadNode);
+            mtx_unlock(&queue->data.synchronization_lock);
+            return false;
+        }
+    }
+    dequeueQueueNode(&queue->producers, currentThreadNode);
+    passTurnToNextProducer(queue);
+    mtx_unlock(&queue->data.synchronization_lock);
+    return true;
+}
+
+void passTurnToNextProducer(struct Queue *queue)
+{
+    // Called with the lock held by a producer leaving the line while there may still be room for the next one.
+    if (queue->producers.head == NULL)
+    {
+        return;
+    }
+    bool has_room = atomic_load(&queue->ring.enqueue_position) - atomic_load(&queue->ring.dequeue_position) <= queue->ring.mask;
+    if (queue->data.backend == QUEUE_BACKEND_SEGMENT)
+    {
+        // Segment slots come free out of order, as records are released, so it is the next slot itself that tells.
+        uint64_t position = atomic_load(&queue->segment.header->enqueue_position);
+        has_room = atomic_load(&fetchSegmentRecord(queue, position)->sequence) == position;
+    }
+    if (has_room)
+    {
+        signalQueueNode(queue->producers.head);
+    }
+}
+
+void wakeHeadProducerAfterPop(struct Queue *queue)
+{
+    // Only the rings and the segment ever turn producers away, so the lock-free lists do not pay for the fence.
+    if (queue->data.backend != QUEUE_BACKEND_RING && queue->data.backend != QUEUE_BACKEND_SPSC_RING && queue->data.backend != QUEUE_BACKEND_SEGMENT)
+    {
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queue->producers.waiting_thread_count > 0)
+    {
+        lockDataQueue(queue);
+        struct QueueNode *headNode = reserveHeadWaiter(&queue->producers);
+        mtx_unlock(&queue->data.synchronization_lock);
+        if (headNode != NULL)
+        {
+            wakeReservedWaiter(headNode);
+        }
+    }
+}
+
+void wakeHeadWaiterAfterPush(struct Queue *queue)
+{
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        wakeSharedSleepers(&queue->segment.shared->item_signal, &queue->segment.shared->sleeping_consumers, 1);
+        notifyReadiness(queue);
+        return;
+    }
+    // Pairs with the fence in dequeueWithoutLock(): either the producer sees the parked consumer or the consumer sees the item.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (queue->threads.waiting_thread_count > 0)
+    {
+        lockDataQueue(queue);
+        // Continuations at the head of the line are served on the spot; a thread behind them is woken as if it had been at the head all along.
+        struct QueueNode *continuations = serveContinuations(queue);
+        struct QueueNode *headNode = queue->threads.head != NULL && queue->threads.head->continuation == NULL ? reserveHeadWaiter(&queue->threads) : NULL;
+        mtx_unlock(&queue->data.synchronization_lock);
+        if (headNode != NULL)
+        {
+            wakeReservedWaiter(headNode);
+        }
+        runContinuations(queue, continuations);
+    }
+    notifyReadiness(queue);
+}
+
+void enqueueBatchWithoutLock(struct Queue *queue, void **items, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (queue->producers.waiting_thread_count == 0 && pushWithoutLock(queue, items[i]))
+        {
+            continue;
+        }
+        // Let consumers drain what this burst has already published before parking for room.
+        wakeHeadWaiterAfterPush(queue);
+        pushInTurn(queue, items[i], NULL);
+    }
+    // Publish the whole burst first; only the oldest waiter may pop, and it passes the turn on while items remain.
+    wakeHeadWaiterAfterPush(queue);
+}
+
+bool dequeueWithoutLock(struct Queue *queue, void **dataPointer, const struct timespec *deadline)
+{
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        return dequeueFromSharedRegion(queue, dataPointer, deadline);
+    }
+    // Only take the lock-free path while nobody is parked, so blocked consumers keep their FIFO priority.
+    if (queue->threads.waiting_thread_count == 0 && (popWithoutLock(queue, dataPointer) || spinUntilPopped(queue, dataPointer)))
+    {
+        wakeHeadProducerAfterPop(queue);
+        return true;
+    }
+    lockDataQueue(queue);
+    // A closed queue gets no more items, so once it is drained consumers return instead of parking.
+    if (queue->data.closed)
+    {
+        bool popped = popWithoutLock(queue, dataPointer);
+        mtx_unlock(&queue->data.synchronization_lock);
+        return popped;
+    }
+    struct QueueNode *currentThreadNode = enqueueQueueNode(&queue->threads);
+    RECORD_STAT(addToCounter(&queue->stats.parks, 1));
+    atomic_thread_fence(memory_order_seq_cst);
+    // Only the oldest waiter may take an item, which preserves the hand-off order of the list backend.
+    RECORD_STAT(bool woken = false);
+    while (queue->threads.head != currentThreadNode || !popWithoutLock(queue, dataPointer))
+    {
+        // Going round again after a wakeup means the wakeup found nothing to take.
+        RECORD_STAT(woken ? addToCounter(&queue->stats.spurious_wakeups, 1) : (void)0);
+        if (!waitOnThreadQueueNode(queue, currentThreadNode, deadline))
+        {
+            if (queue->threads.head == currentThreadNode && popWithoutLock(queue, dataPointer))
+            {
+                break;
+            }
+            dequeueQueueNode(&queue->threads, currentThreadNode);
+            // A signal meant for the oldest waiter may have been absorbed by the thread that is giving up.
+            struct QueueNode *continuations = passTurnToNextConsumer(queue);
+            mtx_unlock(&queue->data.synchronization_lock);
+            runContinuations(queue, continuations);
+            return false;
+        }
+        RECORD_STAT(addToCounter(&queue->stats.wakeups, 1));
+        RECORD_STAT(woken = true);
+        if (queue->data.closed)
+        {
+            // Closing ends the turn order: any waiter may take what is left, and one that finds nothing leaves.
+            bool popped = popWithoutLock(queue, dataPointer);
+            dequeueQueueNode(&queue->threads, currentThreadNode);
+            mtx_unlock(&queue->data.synchronization_lock);
+            return popped;
+        }
+    }
+    dequeueQueueNode(&queue->threads, currentThreadNode);
+    // Pass the turn on if more items are already waiting.
+    struct QueueNode *continuations = passTurnToNextConsumer(queue);
+    mtx_unlock(&queue->data.synchronization_lock);
+    wakeHeadProducerAfterPop(queue);
+    runContinuations(queue, continuations);
+    return true;
+}
+
+bool pushWithoutLock(struct Queue *queue, void *data)
+{
+    if (queue->data.backend == QUEUE_BACKEND_RING)
+    {
+        return pushToRing(queue, data);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        return pushToLane(queue, data);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SPSC_RING)
+    {
+        return pushToSpscRing(queue, data);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_MPSC_LIST)
+    {
+        return pushToMpscList(queue, data);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SEGMENT || queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        return pushToSegment(queue, data);
+    }
+    return pushToLockFreeList(queue, data);
+}
+
+bool popWithoutLock(struct Queue *queue, void **dataPointer)
+{
+    if (queue->data.backend == QUEUE_BACKEND_RING)
+    {
+        return popFromRing(queue, dataPointer);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        return popFromLanes(queue, dataPointer);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SPSC_RING || queue->data.backend == QUEUE_BACKEND_MPSC_LIST)
+    {
+        return popAsSingleConsumer(queue, dataPointer);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SEGMENT || queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        return popFromSegment(queue, dataPointer);
+    }
+    return popFromLockFreeList(queue, dataPointer);
+}
+
+void initLockFreeList(struct Queue *queue)
+{
+    call_once(&hazard_record_key_once, createHazardRecordKey);
+    // The list always holds a dummy element so that head and tail never have to be updated together.
+    struct LockFreeElement *dummy = createLockFreeElement(NULL);
+    atomic_init(&queue->lock_free_list.head, dummy);
+    atomic_init(&queue->lock_free_list.tail, dummy);
+}
+
+void destroyLockFreeList(struct Queue *queue)
+{
+    // No other thread may touch this queue any more, so the elements still linked into it can be released without consulting hazards.
+    struct LockFreeElement *current_element = atomic_load(&queue->lock_free_list.head);
+    while (current_element != NULL)
+    {
+        struct LockFreeElement *next_element = atomic_load(&current_element->next);
+        free(current_element);
+        current_element = next_element;
+    }
+    atomic_store(&queue->lock_free_list.head, NULL);
+    atomic_store(&queue->lock_free_list.tail, NULL);
+    // Retired elements may still be protected by threads working on other queues, so only a hazard-checked scan may release them.
+    reclaimRetiredElements(fetchHazardRecord());
+}
+
+bool pushToLockFreeList(struct Queue *queue, void *data)
+{
+    struct HazardRecord *record = fetchHazardRecord();
+    struct LockFreeElement *new_element = createLockFreeElement(data);
+    // Count the item before publishing it so that the derived size never lags behind a consumer that already took it.
+    addToCounter(&queue->data.items_enqueued, 1);
+    for (;;)
+    {
+        struct LockFreeElement *tail = atomic_load(&queue->lock_free_list.tail);
+        // Announce the tail before dereferencing it, then confirm it was not retired in the meantime.
+        atomic_store(&record->hazards[0], tail);
+        if (tail != atomic_load(&queue->lock_free_list.tail))
+        {
+            continue;
+        }
+        struct LockFreeElement *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&queue->lock_free_list.tail))
+        {
+            continue;
+        }
+        if (next != NULL)
+        {
+            // Another producer linked an element but has not swung the tail yet; help it along.
+            atomic_compare_exchange_strong(&queue->lock_free_list.tail, &tail, next);
+            continue;
+        }
+        struct LockFreeElement *expected = NULL;
+        if (atomic_compare_exchange_strong(&tail->next, &expected, new_element))
+        {
+            atomic_compare_exchange_strong(&queue->lock_free_list.tail, &tail, new_element);
+            break;
+        }
+    }
+    atomic_store(&record->hazards[0], NULL);
+    RECORD_STAT(recordDepth(queue, countQueuedItems(queue)));
+    return true;
+}
+
+bool popFromLockFreeList(struct Queue *queue, void **dataPointer)
+{
+    struct HazardRecord *record = fetchHazardRecord();
+    struct LockFreeElement *head;
+    RECORD_STAT(uint64_t enqueuedAt = 0);
+    for (;;)
+    {
+        head = atomic_load(&queue->lock_free_list.head);
+        atomic_store(&record->hazards[0], head);
+        if (head != atomic_load(&queue->lock_free_list.head))
+        {
+            continue;
+        }
+        struct LockFreeElement *tail = atomic_load(&queue->lock_free_list.tail);
+        struct LockFreeElement *next = atomic_load(&head->next);
+        atomic_store(&record->hazards[1], next);
+        if (head != atomic_load(&queue->lock_free_list.head))
+        {
+            continue;
+        }
+        if (next == NULL)
+        {
+            // Only the dummy element is left, so the list is empty.
+            atomic_store(&record->hazards[0], NULL);
+            atomic_store(&record->hazards[1], NULL);
+            return false;
+        }
+        if (head == tail)
+        {
+            atomic_compare_exchange_strong(&queue->lock_free_list.tail, &tail, next);
+            continue;
+        }
+        // Read the payload before the swing, since afterwards another consumer may retire the element that carries it.
+        *dataPointer = next->pointer;
+        RECORD_STAT(enqueuedAt = next->enqueued_at);
+        if (atomic_compare_exchange_strong(&queue->lock_free_list.head, &head, next))
+        {
+            break;
+        }
+    }
+    atomic_store(&record->hazards[0], NULL);
+    atomic_store(&record->hazards[1], NULL);
+    addToCounter(&queue->data.items_processed, 1);
+    RECORD_STAT(recordTimeInQueue(queue, enqueuedAt));
+    // The old dummy is unreachable now; the element that carried the payload becomes the new dummy.
+    retireLockFreeElement(head);
+    return true;
+}
+
+struct LockFreeElement *createLockFreeElement(void *data)
+{
+    struct HazardRecord *record = fetchHazardRecord();
+    struct LockFreeElement *element = record->reclaimed;
+    if (element != NULL)
+    {
+        record->reclaimed = element->retired_next;
+        record->reclaimed_count--;
+    }
+    else
+    {
+        // Assume successful memory allocation as per the given context.
+        element = (struct LockFreeElement *)malloc(sizeof(struct LockFreeElement));
+    }
+    element->pointer = data;
+    RECORD_STAT(element->enqueued_at = readStatsClock());
+    atomic_init(&element->next, NULL);
+    return element;
+}
+
+void retireLockFreeElement(struct LockFreeElement *element)
+{
+    struct HazardRecord *record = fetchHazardRecord();
+    element->retired_next = record->retired;
+    record->retired = element;
+    record->retired_count++;
+    if (record->retired_count >= HAZARD_RETIRE_THRESHOLD)
+    {
+        reclaimRetiredElements(record);
+    }
+}
+
+void reclaimRetiredElements(struct HazardRecord *record)
+{
+    struct LockFreeElement *still_hazardous = NULL;
+    size_t still_hazardous_count = 0;
+    while (record->retired != NULL)
+    {
+        struct LockFreeElement *element = record->retired;
+        record->retired = element->retired_next;
+        if (isHazardous(element))
+        {
+            element->retired_next = still_hazardous;
+            still_hazardous = element;
+            still_hazardous_count++;
+        }
+        else if (record->reclaimed_count < HAZARD_RECLAIMED_CAPACITY)
+        {
+            // Keep a bounded stash of safe elements so that steady-state pushes do not reach the heap.
+            element->retired_next = record->reclaimed;
+            record->reclaimed = element;
+            record->reclaimed_count++;
+        }
+        else
+        {
+            free(element);
+        }
+    }
+    record->retired = still_hazardous;
+    record->retired_count = still_hazardous_count;
+}
+
+bool isHazardous(struct LockFreeElement *element)
+{
+    for (struct HazardRecord *record = atomic_load(&hazard_records); record != NULL; record = record->next)
+    {
+        for (int i = 0; i < HAZARDS_PER_THREAD; i++)
+        {
+            if (atomic_load(&record->hazards[i]) == element)
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+struct HazardRecord *fetchHazardRecord(void)
+{
+    if (hazard_record != NULL)
+    {
+        return hazard_record;
+    }
+    // Adopt a record abandoned by an exited thread before growing the registry.
+    for (struct HazardRecord *record = atomic_load(&hazard_records); record != NULL; record = record->next)
+    {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&record->active, &expected, true))
+        {
+            hazard_record = record;
+            tss_set(hazard_record_key, record);
+            return record;
+        }
+    }
+    // Assume successful memory allocation as per the given context.
+    // Records start on their own cache line so that one thread publishing a hazard does not disturb its neighbour's record.
+    size_t allocation_size = (sizeof(struct HazardRecord) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    struct HazardRecord *record = (struct HazardRecord *)aligned_alloc(CACHE_LINE_SIZE, allocation_size);
+    memset(record, 0, sizeof(struct HazardRecord));
+    atomic_init(&record->active, true);
+    record->next = atomic_load(&hazard_records);
+    while (!atomic_compare_exchange_weak(&hazard_records, &record->next, record))
+    {
+    }
+    hazard_record = record;
+    // Registering the record arms the destructor that hands it back to the registry when the thread exits.
+    tss_set(hazard_record_key, record);
+    return record;
+}
+
+void createHazardRecordKey(void)
+{
+    tss_create(&hazard_record_key, releaseHazardRecordOnExit);
+}
+
+void releaseHazardRecordOnExit(void *record)
+{
+    // The retired and reclaimed elements stay with the record and are inherited by the next thread that adopts it.
+    atomic_store(&((struct HazardRecord *)record)->active, false);
+}
+
+void initShardedQueue(struct Queue *queue, const struct QueueOptions *options)
+{
+    size_t lane_count = options->lanes;
+    if (lane_count == 0)
+    {
+        long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+        lane_count = processor_count > 0 ? (size_t)processor_count : 1;
+    }
+    // Every lane is an ordinary list queue with a lock of its own; nobody ever blocks on a lane, since waiters park on the sharded queue itself.
+    struct QueueOptions laneOptions = {.backend = QUEUE_BACKEND_LIST, .prefetch_next = options->prefetch_next};
+    // Assume successful memory allocation as per the given context.
+    queue->sharded.lanes = (struct Queue **)malloc(lane_count * sizeof(struct Queue *));
+    queue->sharded.node_count = fetchNumaNodeCount();
+    // The lanes are dealt out to the nodes in turn, and each one's lock and list live in its node's memory.
+    for (size_t i = 0; i < lane_count; i++)
+    {
+        queue->sharded.lanes[i] = createQueueOnNode(&laneOptions, i % queue->sharded.node_count);
+    }
+    queue->sharded.lane_count = lane_count;
+}
+
+void destroyShardedQueue(struct Queue *queue)
+{
+    for (size_t i = 0; i < queue->sharded.lane_count; i++)
+    {
+        queueDestroy(queue->sharded.lanes[i]);
+    }
+    free(queue->sharded.lanes);
+    queue->sharded.lanes = NULL;
+    queue->sharded.lane_count = 0;
+}
+
+bool pushToLane(struct Queue *queue, void *data)
+{
+    queueEnqueue(queue->sharded.lanes[fetchThreadLane(queue)], data);
+    return true;
+}
+
+bool popFromLanes(struct Queue *queue, void **dataPointer)
+{
+    // Drain the thread's own lane first, then steal from the others in turn.
+    // Lanes on the thread's own node come first; those on other nodes are only stolen from once every local one has come up empty.
+    size_t home = fetchThreadLane(queue);
+    size_t node_count = queue->sharded.node_count;
+    for (size_t pass = 0; pass < (node_count > 1 ? 2 : 1); pass++)
+    {
+        for (size_t i = 0; i < queue->sharded.lane_count; i++)
+        {
+            size_t lane_index = (home + i) % queue->sharded.lane_count;
+            if ((lane_index % node_count == home % node_count) != (pass == 0))
+            {
+                continue;
+            }
+            struct Queue *lane = queue->sharded.lanes[lane_index];
+            // Empty lanes are skipped without touching their locks.
+            if (lane->data.total_size > 0 && takeQueuedItem(lane, dataPointer))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void initSpscRing(struct Queue *queue, size_t capacity)
+{
+    // Round the capacity up to a power of two so that indices map onto slots with a mask.
+    size_t slot_count = 2;
+    while (slot_count < (capacity == 0 ? RING_DEFAULT_CAPACITY : capacity))
+    {
+        slot_count <<= 1;
+    }
+    // Assume successful memory allocation as per the given context.
+    queue->spsc_ring.slots = (struct SpscSlot *)malloc(slot_count * sizeof(struct SpscSlot));
+    queue->spsc_ring.mask = slot_count - 1;
+    atomic_flag_clear(&queue->spsc_ring.popping);
+    atomic_init(&queue->spsc_ring.head, 0);
+    atomic_init(&queue->spsc_ring.tail, 0);
+    queue->spsc_ring.cached_head = 0;
+    queue->spsc_ring.cached_tail = 0;
+}
+
+void destroySpscRing(struct Queue *queue)
+{
+    free(queue->spsc_ring.slots);
+    queue->spsc_ring.slots = NULL;
+    queue->spsc_ring.mask = 0;
+}
+
+bool pushToSpscRing(struct Queue *queue, void *data)
+{
+    struct SpscRing *ring = &queue->spsc_ring;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->cached_head > ring->mask)
+    {
+        // The ring looked full when the consumer's index was last read; only now is it worth reading again.
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cached_head > ring->mask)
+        {
+            return false;
+        }
+    }
+    struct SpscSlot *slot = &ring->slots[tail & ring->mask];
+    slot->pointer = data;
+    RECORD_STAT(slot->enqueued_at = readStatsClock());
+    // Publishing the new index is what hands the slot to the consumer.
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    RECORD_STAT(recordDepth(queue, countQueuedItems(queue)));
+    return true;
+}
+
+bool popFromSpscRing(struct Queue *queue, void **dataPointer)
+{
+    struct SpscRing *ring = &queue->spsc_ring;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == ring->cached_tail)
+    {
+        // The ring looked empty when the producer's index was last read; only now is it worth reading again.
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == ring->cached_tail)
+        {
+            return false;
+        }
+    }
+    struct SpscSlot *slot = &ring->slots[head & ring->mask];
+    *dataPointer = slot->pointer;
+    RECORD_STAT(recordTimeInQueue(queue, slot->enqueued_at));
+    // The release store hands the slot back to the producer only once the item has been read out of it.
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool popAsSingleConsumer(struct Queue *queue, void **dataPointer)
+{
+    // With no continuation lined up or running, the one consumer is the only thread that pops, and only it could line one up, so it pops without taking turns.
+    if (atomic_load_explicit(&queue->threads.continuation_count, memory_order_acquire) == 0)
+    {
+        return queue->data.backend == QUEUE_BACKEND_SPSC_RING ? popFromSpscRing(queue, dataPointer) : popFromMpscList(queue, dataPointer);
+    }
+    // Otherwise the consumer, and the continuations running on other threads, pop without the lock, while whoever serves a continuation pops under it.
+    // The flag makes all of them take turns; it only ever guards a pop that cannot block, so whoever finds it taken spins until it is free.
+    atomic_flag *turn = queue->data.backend == QUEUE_BACKEND_SPSC_RING ? &queue->spsc_ring.popping : &queue->mpsc_list.popping;
+    for (unsigned iteration = 0; atomic_flag_test_and_set_explicit(turn, memory_order_acquire); iteration++)
+    {
+        relaxProcessor(iteration);
+    }
+    bool popped = queue->data.backend == QUEUE_BACKEND_SPSC_RING ? popFromSpscRing(queue, dataPointer) : popFromMpscList(queue, dataPointer);
+    atomic_flag_clear_explicit(turn, memory_order_release);
+    return popped;
+}
+
+void initMpscList(struct Queue *queue)
+{
+    atomic_init(&queue->mpsc_list.stub.next, NULL);
+    queue->mpsc_list.stub.pointer = NULL;
+    atomic_init(&queue->mpsc_list.tail, &queue->mpsc_list.stub);
+    queue->mpsc_list.head = &queue->mpsc_list.stub;
+    atomic_flag_clear(&queue->mpsc_list.popping);
+}
+
+void destroyMpscList(struct Queue *queue)
+{
+    // No other thread may touch this queue any more, so every element but the stub and the callers' links can go back to the pool as it is found.
+    struct MpscElement *current_element = queue->mpsc_list.head;
+    while (current_element != NULL)
+    {
+        struct MpscElement *next_element = atomic_load(&current_element->next);
+        if (current_element != &queue->mpsc_list.stub && current_element->pointer != (void *)current_element)
+        {
+            recycleDataElement((struct DataElement *)(void *)current_element);
+        }
+        current_element = next_element;
+    }
+    initMpscList(queue);
+}
+
+bool pushToMpscList(struct Queue *queue, void *data)
+{
+    // Elements come from the thread's element cache like those of the list backend.
+    struct MpscElement *element = (struct MpscElement *)(void *)createDataElement(data);
+    element->pointer = data;
+    appendToMpscList(queue, element);
+    return true;
+}
+
+void appendToMpscList(struct Queue *queue, struct MpscElement *element)
+{
+    RECORD_STAT(element->enqueued_at = readStatsClock());
+    // Count the item before publishing it so that the derived size never lags behind a consumer that already took it.
+    addToCounter(&queue->data.items_enqueued, 1);
+    linkMpscElement(&queue->mpsc_list, element);
+    RECORD_STAT(recordDepth(queue, countQueuedItems(queue)));
+}
+
+void linkMpscElement(struct MpscList *list, struct MpscElement *element)
+{
+    atomic_store_explicit(&element->next, NULL, memory_order_relaxed);
+    // Claiming the tail is a single exchange that never has to be retried; until the previous element is linked to this one, the consumer sees the list end there.
+    struct MpscElement *previous = atomic_exchange_explicit(&list->tail, element, memory_order_acq_rel);
+    atomic_store_explicit(&previous->next, element, memory_order_release);
+}
+
+bool popFromMpscList(struct Queue *queue, void **dataPointer)
+{
+    struct MpscList *list = &queue->mpsc_list;
+    struct MpscElement *head = list->head;
+    struct MpscElement *next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (head == &list->stub)
+    {
+        // Step over the stub; it is linked back in behind the last element when the list runs dry.
+        if (next == NULL)
+        {
+            return false;
+        }
+        list->head = next;
+        head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if (next == NULL)
+    {
+        // A producer that has claimed the tail but not linked its element yet holds up the list until it does; it wakes the consumer once it has.
+        if (head != atomic_load_explicit(&list->tail, memory_order_acquire))
+        {
+            return false;
+        }
+        // Taking the last element would leave the head dangling, so put the stub behind it first.
+        linkMpscElement(list, &list->stub);
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+        if (next == NULL)
+        {
+            return false;
+        }
+    }
+    list->head = next;
+    *dataPointer = head->pointer;
+    RECORD_STAT(recordTimeInQueue(queue, head->enqueued_at));
+    addToCounter(&queue->data.items_processed, 1);
+    // The producer that linked the next element was the last to touch this one, so it goes to the consumer's element cache; a link goes back to its owner instead.
+    if (head->pointer != (void *)head)
+    {
+        recycleDataElement((struct DataElement *)(void *)head);
+    }
+    return true;
+}
+
+bool initSegmentQueue(struct Queue *queue, const struct QueueOptions *options)
+{
+    struct SegmentQueue *segment = &queue->segment;
+    sizeSegment(queue, options, sizeof(struct SegmentHeader));
+    segment->sync_every = options->sync_every;
+    segment->shared = NULL;
+    segment->shared_name = NULL;
+    // Unlike memory, a file can fail to open, grow or map for ordinary reasons such as a bad path, a read-only directory or a full disk, so each step is checked.
+    segment->descriptor = options->segment_path == NULL ? -1 : open(options->segment_path, O_RDWR | O_CREAT, 0644);
+    struct stat status;
+    bool opened = segment->descriptor >= 0 && fcntl(segment->descriptor, F_SETFD, FD_CLOEXEC) == 0 && fstat(segment->descriptor, &status) == 0;
+    bool grown = opened && (size_t)status.st_size < segment->mapping_size;
+    // Reserving the blocks of a file that has to grow finds a full disk here, rather than as a SIGBUS on the first record written to a hole.
+    void *mapping = MAP_FAILED;
+    if (opened && (!grown || posix_fallocate(segment->descriptor, 0, (off_t)segment->mapping_size) == 0))
+    {
+        mapping = mmap(NULL, segment->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->descriptor, 0);
+    }
+    if (mapping == MAP_FAILED)
+    {
+        if (segment->descriptor >= 0)
+        {
+            close(segment->descriptor);
+        }
+        segment->descriptor = -1;
+        return false;
+    }
+    segment->header = (struct SegmentHeader *)mapping;
+    segment->records = (unsigned char *)segment->header + sizeof(struct SegmentHeader);
+    // A file this queue laid out for the same geometry is taken up where it was left; anything else is started afresh.
+    if (!grown && memcmp(segment->header->magic, SEGMENT_MAGIC, sizeof(segment->header->magic)) == 0 && segment->header->record_size == segment->record_size &&
+        segment->header->slot_count == segment->mask + 1)
+    {
+        recoverSegment(queue);
+    }
+    else
+    {
+        formatSegment(queue);
+    }
+    return true;
+}
+
+void sizeSegment(struct Queue *queue, const struct QueueOptions *options, size_t header_size)
+{
+    struct SegmentQueue *segment = &queue->segment;
+    // Round the capacity up to a power of two so that positions map onto slots with a mask.
+    size_t slot_count = 2;
+    while (slot_count < (options->capacity == 0 ? RING_DEFAULT_CAPACITY : options->capacity))
+    {
+        slot_count <<= 1;
+    }
+    segment->mask = slot_count - 1;
+    segment->record_size = options->record_size;
+    segment->record_stride = (sizeof(struct SegmentRecord) + options->record_size + alignof(struct SegmentRecord) - 1) / alignof(struct SegmentRecord) * alignof(struct SegmentRecord);
+    segment->mapping_size = header_size + slot_count * segment->record_stride;
+    atomic_init(&segment->enqueue_count, 0);
+}
+
+void destroySegmentQueue(struct Queue *queue)
+{
+    syncSegment(queue);
+    munmap(queue->segment.header, queue->segment.mapping_size);
+    close(queue->segment.descriptor);
+    queue->segment.header = NULL;
+    queue->segment.records = NULL;
+    queue->segment.descriptor = -1;
+}
+
+void formatSegment(struct Queue *queue)
+{
+    struct SegmentHeader *header = queue->segment.header;
+    for (uint64_t position = 0; position <= queue->segment.mask; position++)
+    {
+        atomic_store_explicit(&fetchSegmentRecord(queue, position)->sequence, position, memory_order_relaxed);
+    }
+    header->record_size = queue->segment.record_size;
+    header->slot_count = queue->segment.mask + 1;
+    atomic_store(&header->enqueue_position, 0);
+    atomic_store(&header->dequeue_position, 0);
+    // The magic goes in last, so that a file whose formatting was cut short is formatted again next time.
+    memcpy(header->magic, SEGMENT_MAGIC, sizeof(header->magic));
+    syncSegment(queue);
+}
+
+void recoverSegment(struct Queue *queue)
+{
+    struct SegmentHeader *header = queue->segment.header;
+    uint64_t slot_count = queue->segment.mask + 1;
+    uint64_t dequeue_position = atomic_load(&header->dequeue_position);
+    uint64_t enqueue_position = atomic_load(&header->enqueue_position);
+    if (enqueue_position - dequeue_position > slot_count)
+    {
+        enqueue_position = dequeue_position + slot_count;
+    }
+    // A record is kept while its sequence still says filled: never dequeued, or dequeued but not released before the process stopped, in which case it is delivered again.
+    // An unreleased record holds its slot, so none can be older than one lap behind the dequeue position, and no slot matches two positions of that range.
+    uint64_t first_kept = dequeue_position;
+    uint64_t kept_count = 0;
+    bool contiguous = true;
+    for (uint64_t position = dequeue_position > slot_count ? dequeue_position - slot_count : 0; position != enqueue_position; position++)
+    {
+        if (atomic_load_explicit(&fetchSegmentRecord(queue, position)->sequence, memory_order_relaxed) == position + 1)
+        {
+            first_kept = kept_count == 0 ? position : first_kept;
+            contiguous = contiguous && position == first_kept + kept_count;
+            kept_count++;
+        }
+    }
+    if (!contiguous)
+    {
+        // Released records, and slots claimed by a producer that died before filling them, leave gaps no consumer could get past; the kept records are closed up.
+        // They go through a copy, since moving one in place could overwrite another not yet moved.
+        // Assume successful memory allocation as per the given context.
+        unsigned char *kept_payloads = (unsigned char *)malloc(kept_count * queue->segment.record_size);
+        size_t kept_index = 0;
+        for (uint64_t position = first_kept; kept_index < kept_count; position++)
+        {
+            struct SegmentRecord *record = fetchSegmentRecord(queue, position);
+            if (atomic_load_explicit(&record->sequence, memory_order_relaxed) == position + 1)
+            {
+                memcpy(kept_payloads + kept_index++ * queue->segment.record_size, record->payload, queue->segment.record_size);
+            }
+        }
+        for (kept_index = 0; kept_index < kept_count; kept_index++)
+        {
+            struct SegmentRecord *record = fetchSegmentRecord(queue, first_kept + kept_index);
+            memcpy(record->payload, kept_payloads + kept_index * queue->segment.record_size, queue->segment.record_size);
+            atomic_store_explicit(&record->sequence, first_kept + kept_index + 1, memory_order_relaxed);
+        }
+        free(kept_payloads);
+    }
+    // Every other slot is free for the producer that reaches it next.
+    for (uint64_t position = first_kept + kept_count; position != first_kept + slot_count; position++)
+    {
+        atomic_store_explicit(&fetchSegmentRecord(queue, position)->sequence, position, memory_order_relaxed);
+    }
+    atomic_store(&header->dequeue_position, first_kept);
+    atomic_store(&header->enqueue_position, first_kept + kept_count);
+    addToCounter(&queue->data.items_enqueued, kept_count);
+}
+
+struct SegmentRecord *fetchSegmentRecord(struct Queue *queue, uint64_t position)
+{
+    return (struct SegmentRecord *)(queue->segment.records + (position & queue->segment.mask) * queue->segment.record_stride);
+}
+
+bool pushToSegment(struct Queue *queue, void *data)
+{
+    struct SegmentRecord *record;
+    uint64_t position = atomic_load_explicit(&queue->segment.header->enqueue_position, memory_order_relaxed);
+    for (;;)
+    {
+        record = fetchSegmentRecord(queue, position);
+        uint64_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        int64_t difference = (int64_t)(sequence - position);
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->segment.header->enqueue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            // The slot still holds a record from the previous lap that has not been released, so the segment is full.
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->segment.header->enqueue_position, memory_order_relaxed);
+        }
+    }
+    // Enqueuing is a copy into the mapping; the kernel writes it back to the file.
+    memcpy(record->payload, data, queue->segment.record_size);
+    addToCounter(&queue->data.items_enqueued, 1);
+    atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+    RECORD_STAT(recordDepth(queue, countQueuedItems(queue)));
+    if (queue->segment.sync_every > 0 && (atomic_fetch_add_explicit(&queue->segment.enqueue_count, 1, memory_order_relaxed) + 1) % queue->segment.sync_every == 0)
+    {
+        syncSegment(queue);
+    }
+    return true;
+}
+
+bool popFromSegment(struct Queue *queue, void **dataPointer)
+{
+    struct SegmentRecord *record;
+    uint64_t position = atomic_load_explicit(&queue->segment.header->dequeue_position, memory_order_relaxed);
+    for (;;)
+    {
+        record = fetchSegmentRecord(queue, position);
+        uint64_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        int64_t difference = (int64_t)(sequence - (position + 1));
+        if (difference == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->segment.header->dequeue_position, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (difference < 0)
+        {
+            return false;
+        }
+        else
+        {
+            position = atomic_load_explicit(&queue->segment.header->dequeue_position, memory_order_relaxed);
+        }
+    }
+    // The record stays filled, and its slot taken, until the caller releases it.
+    *dataPointer = record->payload;
+    addToCounter(&queue->data.items_processed, 1);
+    return true;
+}
+
+void syncSegment(struct Queue *queue)
+{
+    msync(queue->segment.header, queue->segment.mapping_size, MS_SYNC);
+}
+
+void releaseRecord(void *record)
+{
+    queueReleaseRecord(&defaultQueue, record);
+}
+
+void queueReleaseRecord(struct Queue *queue, void *record)
+{
+    if (enterQueue(queue))
+    {
+        releaseRecordAdmitted(queue, record);
+    }
+    leaveQueue(queue);
+}
+
+void releaseRecordAdmitted(struct Queue *queue, void *record)
+{
+    struct SegmentRecord *released = (struct SegmentRecord *)(void *)((unsigned char *)record - offsetof(struct SegmentRecord, payload));
+    // The sequence still reads position + 1 from the enqueue; moving it on by a lap hands the slot to the producer of the next one.
+    uint64_t sequence = atomic_load_explicit(&released->sequence, memory_order_relaxed);
+    atomic_store_explicit(&released->sequence, sequence + queue->segment.mask, memory_order_release);
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        wakeSharedSleepers(&queue->segment.shared->room_signal, &queue->segment.shared->sleeping_producers, 1);
+        return;
+    }
+    wakeHeadProducerAfterPop(queue);
+}
+
+bool initSharedRegion(struct Queue *queue, const struct QueueOptions *options)
+{
+    struct SegmentQueue *segment = &queue->segment;
+    sizeSegment(queue, options, sizeof(struct SharedRegionHeader));
+    // Shared memory has no disk behind it to sync to.
+    segment->sync_every = 0;
+    segment->shared = NULL;
+    segment->shared_name = NULL;
+    segment->descriptor = -1;
+    if (options->shared_name == NULL)
+    {
+        return false;
+    }
+    // Assume successful memory allocation as per the given context.
+    size_t name_length = strlen(options->shared_name) + 1;
+    segment->shared_name = (char *)malloc(name_length);
+    memcpy(segment->shared_name, options->shared_name, name_length);
+    // The last queue leaving a region removes it, and a queue caught between the two finds nothing to open, or nothing to join, and tries again.
+    // Any other failure, such as an invalid name, a region it may not open or a creator that never finished, is final.
+    bool retry = false;
+    while (!openSharedRegion(queue, &retry))
+    {
+        if (!retry)
+        {
+            free(segment->shared_name);
+            segment->shared_name = NULL;
+            return false;
+        }
+        thrd_yield();
+    }
+    return true;
+}
+
+bool openSharedRegion(struct Queue *queue, bool *retry)
+{
+    struct SegmentQueue *segment = &queue->segment;
+    *retry = false;
+    // The first queue to get here creates the region and sizes it; the others attach to it.
+    segment->descriptor = shm_open(segment->shared_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    bool created = segment->descriptor >= 0;
+    if (!created && errno == EEXIST)
+    {
+        segment->descriptor = shm_open(segment->shared_name, O_RDWR, 0600);
+        *retry = segment->descriptor < 0 && errno == ENOENT;
+    }
+    if (segment->descriptor < 0)
+    {
+        return false;
+    }
+    bool sized = created ? ftruncate(segment->descriptor, (off_t)segment->mapping_size) == 0 : waitForSharedRegionSize(queue);
+    void *mapping = sized ? mmap(NULL, segment->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->descriptor, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED)
+    {
+        abandonSharedRegion(queue, created);
+        return false;
+    }
+    segment->shared = (struct SharedRegionHeader *)mapping;
+    segment->header = &segment->shared->segment;
+    segment->records = (unsigned char *)segment->shared + sizeof(struct SharedRegionHeader);
+    if (created)
+    {
+        // The new region reads all zeroes, the words included; only the ring needs laying out.
+        formatSegment(queue);
+        atomic_store(&segment->shared->attached_count, 1);
+        atomic_store_explicit(&segment->shared->ready, 1, memory_order_release);
+        return true;
+    }
+    // A creator that has not laid the region out in time most likely died first; a region laid out for another geometry cannot be shared.
+    bool ready = true;
+    for (long waited = 0; atomic_load_explicit(&segment->shared->ready, memory_order_acquire) == 0; waited += SHARED_POLL_INTERVAL_NS)
+    {
+        if (waited >= SHARED_ATTACH_TIMEOUT_NS)
+        {
+            ready = false;
+            break;
+        }
+        thrd_sleep(&(struct timespec){.tv_nsec = SHARED_POLL_INTERVAL_NS}, NULL);
+    }
+    if (ready && segment->header->record_size == segment->record_size && segment->header->slot_count == segment->mask + 1)
+    {
+        // A region with no queue left attached is about to be removed, and must not be joined.
+        uint32_t attached = atomic_load(&segment->shared->attached_count);
+        while (attached != 0)
+        {
+            if (atomic_compare_exchange_weak(&segment->shared->attached_count, &attached, attached + 1))
+            {
+                return true;
+            }
+        }
+        *retry = true;
+    }
+    munmap(segment->shared, segment->mapping_size);
+    segment->shared = NULL;
+    abandonSharedRegion(queue, false);
+    return false;
+}
+
+bool waitForSharedRegionSize(struct Queue *queue)
+{
+    // The creator sizes the region straight after creating it, so one that is still empty once the timeout has passed is given up on.
+    struct stat status;
+    for (long waited = 0; fstat(queue->segment.descriptor, &status) == 0; waited += SHARED_POLL_INTERVAL_NS)
+    {
+        if (status.st_size != 0)
+        {
+            // Touching a page past the end of a region sized for another geometry would fault.
+            return (size_t)status.st_size >= queue->segment.mapping_size;
+        }
+        if (waited >= SHARED_ATTACH_TIMEOUT_NS)
+        {
+            return false;
+        }
+        thrd_sleep(&(struct timespec){.tv_nsec = SHARED_POLL_INTERVAL_NS}, NULL);
+    }
+    return false;
+}
+
+void abandonSharedRegion(struct Queue *queue, bool created)
+{
+    // A region this queue created but could not set up is removed again, so that the next queue to come creates it afresh.
+    if (created)
+    {
+        shm_unlink(queue->segment.shared_name);
+    }
+    close(queue->segment.descriptor);
+    queue->segment.descriptor = -1;
+}
+
+void destroySharedRegion(struct Queue *queue)
+{
+    struct SegmentQueue *segment = &queue->segment;
+    if (atomic_fetch_sub(&segment->shared->attached_count, 1) == 1)
+    {
+        shm_unlink(segment->shared_name);
+    }
+    munmap(segment->shared, segment->mapping_size);
+    close(segment->descriptor);
+    free(segment->shared_name);
+    segment->shared = NULL;
+    segment->shared_name = NULL;
+    segment->header = NULL;
+    segment->records = NULL;
+    segment->descriptor = -1;
+}
+
+bool pushToSharedRegion(struct Queue *queue, void *data, const struct timespec *deadline)
+{
+    struct SharedRegionHeader *shared = queue->segment.shared;
+    for (;;)
+    {
+        if (queue->data.closed)
+        {
+            return false;
+        }
+        if (pushWithoutLock(queue, data))
+        {
+            return true;
+        }
+        // Announce the sleep before looking for room one last time; pairs with the fence in wakeSharedSleepers(), so that either the release that makes room
+        // sees this producer or this producer sees the room. The signal is read first, so that a release in between makes the wait return at once.
+        uint32_t signal = atomic_load(&shared->room_signal);
+        atomic_fetch_add(&shared->sleeping_producers, 1);
+        atomic_fetch_add(&queue->producers.waiting_thread_count, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool pushed = pushWithoutLock(queue, data);
+        bool woken = pushed || queue->data.closed || waitOnSharedWord(&shared->room_signal, signal, deadline);
+        atomic_fetch_sub(&queue->producers.waiting_thread_count, 1);
+        atomic_fetch_sub(&shared->sleeping_producers, 1);
+        if (pushed)
+        {
+            return true;
+        }
+        if (!woken)
+        {
+            return !queue->data.closed && pushWithoutLock(queue, data);
+        }
+    }
+}
+
+bool dequeueFromSharedRegion(struct Queue *queue, void **dataPointer, const struct timespec *deadline)
+{
+    struct SharedRegionHeader *shared = queue->segment.shared;
+    bool slept = false;
+    for (;;)
+    {
+        if (popWithoutLock(queue, dataPointer) || spinUntilPopped(queue, dataPointer))
+        {
+            // A wakeup goes to one sleeper per publish, and a batch publishes several records behind a single one, so a woken consumer passes it on while records remain.
+            if (slept && countQueuedItems(queue) > 0)
+            {
+                wakeSharedSleepers(&shared->item_signal, &shared->sleeping_consumers, 1);
+            }
+            return true;
+        }
+        // A closed queue gets no more items from this process, so once the region is drained its consumers return instead of sleeping.
+        if (queue->data.closed)
+        {
+            return false;
+        }
+        // The same handshake as a blocked producer's, against the producer that publishes the next record.
+        uint32_t signal = atomic_load(&shared->item_signal);
+        atomic_fetch_add(&shared->sleeping_consumers, 1);
+        atomic_fetch_add(&queue->threads.waiting_thread_count, 1);
+        RECORD_STAT(addToCounter(&queue->stats.parks, 1));
+        atomic_thread_fence(memory_order_seq_cst);
+        bool popped = popWithoutLock(queue, dataPointer);
+        bool woken = popped || queue->data.closed || waitOnSharedWord(&shared->item_signal, signal, deadline);
+        atomic_fetch_sub(&queue->threads.waiting_thread_count, 1);
+        atomic_fetch_sub(&shared->sleeping_consumers, 1);
+        if (popped)
+        {
+            return true;
+        }
+        if (!woken)
+        {
+            return popWithoutLock(queue, dataPointer);
+        }
+        RECORD_STAT(addToCounter(&queue->stats.wakeups, 1));
+        slept = true;
+    }
+}
+
+bool waitOnSharedWord(_Atomic uint32_t *word, uint32_t expected, const struct timespec *deadline)
+{
+    // Returns false only once the deadline has passed; a NULL deadline waits without limit. Returning early is harmless, since callers look again and go back to sleep.
+#ifdef SHARE_FUTEX_WORDS
+    // A futex without the private flag is keyed on the page behind the word rather than on the address, so a wake from any process mapping the region reaches it.
+    long result = syscall(SYS_futex, word, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    return !(result != 0 && errno == ETIMEDOUT);
+#else
+    while (atomic_load(word) == expected)
+    {
+        if (hasDeadlinePassed(deadline))
+        {
+            return false;
+        }
+        thrd_sleep(&(struct timespec){.tv_nsec = SHARED_POLL_INTERVAL_NS}, NULL);
+    }
+    return true;
+#endif
+}
+
+void wakeSharedSleepers(_Atomic uint32_t *word, _Atomic uint32_t *sleepers, uint32_t count)
+{
+    // Pairs with the fence a sleeper issues after announcing itself; the system call is only made when somebody is asleep or about to be.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(sleepers) == 0)
+    {
+        return;
+    }
+    atomic_fetch_add(word, 1);
+#ifdef SHARE_FUTEX_WORDS
+    syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0);
+#else
+    (void)count;
+#endif
+}
+
+void openReadinessDescriptor(struct Queue *queue, bool requested)
+{
+    queue->readiness.read_descriptor = -1;
+    queue->readiness.write_descriptor = -1;
+    atomic_init(&queue->readiness.pending, false);
+    if (!requested)
+    {
+        return;
+    }
+    // Both ends are non-blocking: a producer must never stall on a full pipe, and draining stops as soon as nothing is left to read.
+#ifdef READINESS_EVENTFD
+    int descriptor = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    queue->readiness.read_descriptor = descriptor;
+    queue->readiness.write_descriptor = descriptor;
+#else
+    int descriptors[2];
+    if (pipe(descriptors) != 0)
+    {
+        return;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(descriptors[i], F_SETFL, fcntl(descriptors[i], F_GETFL) | O_NONBLOCK);
+        fcntl(descriptors[i], F_SETFD, FD_CLOEXEC);
+    }
+    queue->readiness.read_descriptor = descriptors[0];
+    queue->readiness.write_descriptor = descriptors[1];
+#endif
+}
+
+void closeReadinessDescriptor(struct Queue *queue)
+{
+    if (queue->readiness.read_descriptor >= 0)
+    {
+        close(queue->readiness.read_descriptor);
+    }
+    if (queue->readiness.write_descriptor >= 0 && queue->readiness.write_descriptor != queue->readiness.read_descriptor)
+    {
+        close(queue->readiness.write_descriptor);
+    }
+    queue->readiness.read_descriptor = -1;
+    queue->readiness.write_descriptor = -1;
+}
+
+void notifyReadiness(struct Queue *queue)
+{
+    // Called by producers after publishing an item; a queue without a descriptor pays for one read-only load.
+    if (queue->readiness.write_descriptor < 0)
+    {
+        return;
+    }
+    // Pairs with the fence in rearmReadiness(): either this producer sees the notification cleared or the consumer sees the item.
+    atomic_thread_fence(memory_order_seq_cst);
+    // While a notification is pending the flag is only read, so a burst of items costs a single write to the descriptor.
+    if (!atomic_load_explicit(&queue->readiness.pending, memory_order_relaxed) && !atomic_exchange(&queue->readiness.pending, true))
+    {
+        signalReadinessDescriptor(queue);
+    }
+}
+
+void signalReadinessDescriptor(struct Queue *queue)
+{
+    // A write that fails for lack of room leaves the descriptor readable anyway, which is all it has to be.
+#ifdef READINESS_EVENTFD
+    uint64_t increment = 1;
+    ssize_t written = write(queue->readiness.write_descriptor, &increment, sizeof(increment));
+#else
+    char byte = 0;
+    ssize_t written = write(queue->readiness.write_descriptor, &byte, sizeof(byte));
+#endif
+    (void)written;
+}
+
+bool rearmReadiness(struct Queue *queue)
+{
+    // Called by a consumer that found the queue empty; returns whether a notification was pending, in which case the queue has to be looked at once more.
+    if (queue->readiness.read_descriptor < 0 || !atomic_load(&queue->readiness.pending))
+    {
+        return false;
+    }
+    // A closed queue stays readable, which is how an event loop that finds it empty learns that no more items will come.
+    if (queue->data.closed)
+    {
+        return false;
+    }
+    // Drain the descriptor before clearing the flag, so that a producer that sets it again afterwards leaves it readable.
+#ifdef READINESS_EVENTFD
+    uint64_t counter;
+    while (read(queue->readiness.read_descriptor, &counter, sizeof(counter)) < 0 && errno == EINTR)
+    {
+    }
+#else
+    char bytes[64];
+    ssize_t bytes_read;
+    while ((bytes_read = read(queue->readiness.read_descriptor, bytes, sizeof(bytes))) > 0 || (bytes_read < 0 && errno == EINTR))
+    {
+    }
+#endif
+    atomic_store(&queue->readiness.pending, false);
+    atomic_thread_fence(memory_order_seq_cst);
+    return true;
+}
+
+int queueNotificationDescriptor(struct Queue *queue)
+{
+    return queue->readiness.read_descriptor;
+}
+
+size_t fetchThreadNumber(void)
+{
+    // Threads are numbered round-robin on first use and keep the same number in every queue.
+    if (thread_number == 0)
+    {
+        thread_number = atomic_fetch_add(&next_thread_number, 1) + 1;
+    }
+    return thread_number - 1;
+}
+
+size_t fetchThreadLane(struct Queue *queue)
+{
+    size_t node_count = queue->sharded.node_count;
+    if (node_count == 1)
+    {
+        return fetchThreadNumber() % queue->sharded.lane_count;
+    }
+    // Threads are spread round-robin over the lanes of their own node, unless there are too few lanes for the node to have one.
+    size_t node = fetchThreadNode() % node_count;
+    size_t node_lanes = (queue->sharded.lane_count + node_count - 1 - node) / node_count;
+    if (node_lanes == 0)
+    {
+        return fetchThreadNumber() % queue->sharded.lane_count;
+    }
+    return node + node_count * (fetchThreadNumber() % node_lanes);
+}
+
+size_t fetchThreadNode(void)
+{
+    // The node is looked up on first use and kept, so a thread that migrates to another node afterwards still counts as local to the first; pin threads that care.
+    if (thread_node == 0)
+    {
+        unsigned int node = 0;
+#ifdef PLACE_ON_NUMA_NODES
+        unsigned int processor;
+        if (syscall(SYS_getcpu, &processor, &node, NULL) != 0)
+        {
+            node = 0;
+        }
+#endif
+        thread_node = node % fetchNumaNodeCount() + 1;
+    }
+    return thread_node - 1;
+}
+
+size_t fetchNumaNodeCount(void)
+{
+    call_once(&numa_topology_once, discoverNumaTopology);
+    return numa_node_count;
+}
+
+void discoverNumaTopology(void)
+{
+#ifdef PLACE_ON_NUMA_NODES
+    // The online nodes are listed as ranges such as "0-1" or "0,2"; the highest node number decides how many pools are in use.
+    FILE *nodes = fopen("/sys/devices/system/node/online", "r");
+    if (nodes == NULL)
+    {
+        return;
+    }
+    unsigned int node;
+    size_t highest_node = 0;
+    while (fscanf(nodes, "%u", &node) == 1)
+    {
+        highest_node = node > highest_node ? node : highest_node;
+        // Skip the separator.
+        if (fgetc(nodes) == EOF)
+        {
+            break;
+        }
+    }
+    fclose(nodes);
+    numa_node_count = highest_node + 1 < ELEMENT_POOL_COUNT ? highest_node + 1 : ELEMENT_POOL_COUNT;
+#endif
+}
+
+void *allocateOnNumaNode(size_t size, size_t node)
+{
+#ifdef PLACE_ON_NUMA_NODES
+    // The memory policy is set on whole pages, so the block is rounded up to pages and bound before anything touches it.
+    // Binding is only a preference: the kernel falls back to other nodes when this one is full, and a failed call simply leaves first-touch placement in force.
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t allocation_size = (size + page_size - 1) / page_size * page_size;
+    void *memory = aligned_alloc(page_size, allocation_size);
+    unsigned long node_mask = 1UL << node;
+    syscall(SYS_mbind, memory, allocation_size, MPOL_PREFERRED, &node_mask, sizeof(node_mask) * 8, MPOL_MF_MOVE);
+    return memory;
+#else
+    (void)node;
+    // Round the allocation up to whole cache lines so that the block shares no line with its heap neighbours.
+    size_t allocation_size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    return aligned_alloc(CACHE_LINE_SIZE, allocation_size);
+#endif
+}
+
+void addToCounter(struct StripedCounter *counter, unsigned long amount)
+{
+    // Relaxed is enough: the tallies only feed the statistics, never the hand-over of an item.
+    atomic_fetch_add_explicit(&counter->stripes[fetchThreadNumber() % COUNTER_STRIPES].value, amount, memory_order_relaxed);
+}
+
+unsigned long readCounter(struct StripedCounter *counter)
+{
+    // Writers are not stopped, so the sum may miss updates still in flight, but it never goes backwards between two reads.
+    unsigned long total = 0;
+    for (size_t i = 0; i < COUNTER_STRIPES; i++)
+    {
+        total += atomic_load_explicit(&counter->stripes[i].value, memory_order_relaxed);
+    }
+    return total;
+}
+
+void resetCounter(struct StripedCounter *counter)
+{
+    for (size_t i = 0; i < COUNTER_STRIPES; i++)
+    {
+        atomic_init(&counter->stripes[i].value, 0);
+    }
+}
+
+void lockDataQueue(struct Queue *queue)
+{
+#ifdef QUEUE_STATS
+    // Trying first tells an uncontended acquisition apart from one that had to wait for another thread.
+    if (mtx_trylock(&queue->data.synchronization_lock) != thrd_success)
+    {
+        addToCounter(&queue->stats.lock_contentions, 1);
+        mtx_lock(&queue->data.synchronization_lock);
+    }
+    addToCounter(&queue->stats.lock_acquisitions, 1);
+#else
+    mtx_lock(&queue->data.synchronization_lock);
+#endif
+}
+
+#ifdef QUEUE_STATS
+void resetStatCounters(struct Queue *queue)
+{
+    resetCounter(&queue->stats.lock_acquisitions);
+    resetCounter(&queue->stats.lock_contentions);
+    resetCounter(&queue->stats.parks);
+    resetCounter(&queue->stats.wakeups);
+    resetCounter(&queue->stats.spurious_wakeups);
+    atomic_init(&queue->stats.max_depth, 0);
+    for (size_t i = 0; i < COUNTER_STRIPES; i++)
+    {
+        for (size_t j = 0; j < QUEUE_LATENCY_BUCKETS; j++)
+        {
+            atomic_init(&queue->stats.time_in_queue.stripes[i].buckets[j], 0);
+        }
+    }
+}
+
+void addStatsOf(struct Queue *queue, struct QueueStats *snapshot)
+{
+    snapshot->lock_acquisitions += readCounter(&queue->stats.lock_acquisitions);
+    snapshot->lock_contentions += readCounter(&queue->stats.lock_contentions);
+    snapshot->parks += readCounter(&queue->stats.parks);
+    snapshot->wakeups += readCounter(&queue->stats.wakeups);
+    snapshot->spurious_wakeups += readCounter(&queue->stats.spurious_wakeups);
+    size_t depth = atomic_load_explicit(&queue->stats.max_depth, memory_order_relaxed);
+    snapshot->max_depth = depth > snapshot->max_depth ? depth : snapshot->max_depth;
+    for (size_t i = 0; i < COUNTER_STRIPES; i++)
+    {
+        for (size_t j = 0; j < QUEUE_LATENCY_BUCKETS; j++)
+        {
+            snapshot->time_in_queue[j] += atomic_load_explicit(&queue->stats.time_in_queue.stripes[i].buckets[j], memory_order_relaxed);
+        }
+    }
+}
+
+void recordDepth(struct Queue *queue, size_t depth)
+{
+    size_t deepest = atomic_load_explicit(&queue->stats.max_depth, memory_order_relaxed);
+    while (depth > deepest && !atomic_compare_exchange_weak_explicit(&queue->stats.max_depth, &deepest, depth, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+void recordTimeInQueue(struct Queue *queue, uint64_t enqueuedAt)
+{
+    // Ticks read on different cores may be slightly out of step, so a stay that seems to end before it began counts as none.
+    uint64_t now = readStatsClock();
+    uint64_t nanoseconds = now > enqueuedAt ? (uint64_t)((double)(now - enqueuedAt) * stats_clock_scale) : 0;
+    addToHistogram(&queue->stats.time_in_queue, fetchLatencyBucket(nanoseconds));
+}
+
+void addToHistogram(struct LatencyHistogram *histogram, size_t bucket)
+{
+    atomic_fetch_add_explicit(&histogram->stripes[fetchThreadNumber() % COUNTER_STRIPES].buckets[bucket], 1, memory_order_relaxed);
+}
+
+uint64_t readStatsClock(void)
+{
+#ifdef STATS_CLOCK_TSC
+    if (stats_clock_uses_tsc)
+    {
+        return __rdtsc();
+    }
+#endif
+    return readFallbackClock();
+}
+
+uint64_t readFallbackClock(void)
+{
+    struct timespec now;
+#ifdef TIME_MONOTONIC
+    timespec_get(&now, TIME_MONOTONIC);
+#else
+    // Without a monotonic base a clock step can distort the stays measured across it, which the histogram tolerates.
+    timespec_get(&now, TIME_UTC);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void calibrateStatsClock(void)
+{
+#ifdef STATS_CLOCK_TSC
+    // Only an invariant counter ticks at one rate on every core and through frequency changes and sleep states.
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1u << 8)) != 0)
+    {
+        // Time a short busy wait against the fallback clock to learn the tick rate.
+        uint64_t startNanoseconds = readFallbackClock();
+        uint64_t startTicks = __rdtsc();
+        uint64_t elapsed;
+        while ((elapsed = readFallbackClock() - startNanoseconds) < STATS_CLOCK_CALIBRATION_NS)
+        {
+        }
+        stats_clock_scale = (double)elapsed / (double)(__rdtsc() - startTicks);
+        stats_clock_uses_tsc = true;
+    }
+#endif
+}
+#endif
+
+size_t countQueuedItems(struct Queue *queue)
+{
+    if (queue->data.backend == QUEUE_BACKEND_LIST)
+    {
+        return queue->data.total_size;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        // Each lane counts its own items, so producers and consumers never share a global counter.
+        size_t total = 0;
+        for (size_t i = 0; i < queue->sharded.lane_count; i++)
+        {
+            total += queue->sharded.lanes[i]->data.total_size;
+        }
+        return total;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SPSC_RING)
+    {
+        // The ring's own indices count exactly; reading the consumer's first keeps the difference from going negative.
+        size_t head = atomic_load_explicit(&queue->spsc_ring.head, memory_order_acquire);
+        return atomic_load_explicit(&queue->spsc_ring.tail, memory_order_acquire) - head;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        // Other processes count their items in tallies of their own, so the region's positions are read instead, the consumers' first.
+        uint64_t dequeued = atomic_load(&queue->segment.header->dequeue_position);
+        return (size_t)(atomic_load(&queue->segment.header->enqueue_position) - dequeued);
+    }
+    // Read the consumers' tally first; since producers count items before publishing them, the difference can only overshoot, and it is clamped in case the stripes were caught mid-update.
+    unsigned long processed = readCounter(&queue->data.items_processed);
+    unsigned long enqueued = readCounter(&queue->data.items_enqueued);
+    return enqueued > processed ? enqueued - processed : 0;
+}
+
+size_t queueSize(struct Queue *queue)
+{
+    size_t total = enterQueue(queue) ? countQueuedItems(queue) : 0;
+    leaveQueue(queue);
+    return total;
+}
+
+size_t queueWaiting(struct Queue *queue)
+{
+    return queue->threads.waiting_thread_count;
+}
+
+size_t queueVisited(struct Queue *queue)
+{
+    size_t total = enterQueue(queue) ? countVisitedItems(queue) : 0;
+    leaveQueue(queue);
+    return total;
+}
+
+size_t countVisitedItems(struct Queue *queue)
+{
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < queue->sharded.lane_count; i++)
+        {
+            total += readCounter(&queue->sharded.lanes[i]->data.items_processed);
+        }
+        return total;
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SPSC_RING)
+    {
+        return atomic_load_explicit(&queue->spsc_ring.head, memory_order_acquire);
+    }
+    if (queue->data.backend == QUEUE_BACKEND_SHARED_MEMORY)
+    {
+        return (size_t)atomic_load(&queue->segment.header->dequeue_position);
+    }
+    return readCounter(&queue->data.items_processed);
+}
+
+size_t fetchLatencyBucket(uint64_t nanoseconds)
+{
+    // Stays below QUEUE_LATENCY_SUB_BUCKETS nanoseconds have a bucket each; above that, every power of two is split into QUEUE_LATENCY_SUB_BUCKETS equal steps.
+    if (nanoseconds < QUEUE_LATENCY_SUB_BUCKETS)
+    {
+        return (size_t)nanoseconds;
+    }
+    unsigned exponent = 0;
+    for (uint64_t rest = nanoseconds >> 1; rest != 0; rest >>= 1)
+    {
+        exponent++;
+    }
+    size_t step = (size_t)(nanoseconds >> (exponent - QUEUE_LATENCY_SUB_BUCKET_BITS)) - QUEUE_LATENCY_SUB_BUCKETS;
+    size_t bucket = (size_t)(exponent - QUEUE_LATENCY_SUB_BUCKET_BITS + 1) * QUEUE_LATENCY_SUB_BUCKETS + step;
+    return bucket < QUEUE_LATENCY_BUCKETS ? bucket : QUEUE_LATENCY_BUCKETS - 1;
+}
+
+uint64_t latencyBucketFloor(size_t bucket)
+{
+    if (bucket < QUEUE_LATENCY_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    // The buckets of one power of two are each 2^(bucket / QUEUE_LATENCY_SUB_BUCKETS - 1) nanoseconds wide.
+    unsigned shift = (unsigned)(bucket / QUEUE_LATENCY_SUB_BUCKETS - 1);
+    return (uint64_t)(QUEUE_LATENCY_SUB_BUCKETS + bucket % QUEUE_LATENCY_SUB_BUCKETS) << shift;
+}
+
+bool queueStats(struct Queue *queue, struct QueueStats *snapshot)
+{
+    memset(snapshot, 0, sizeof(struct QueueStats));
+#ifdef QUEUE_STATS
+    // A sharded queue parks its consumers on its own lock but keeps the items in its lanes, so all of them contribute.
+    addStatsOf(queue, snapshot);
+    if (queue->data.backend == QUEUE_BACKEND_SHARDED)
+    {
+        for (size_t i = 0; i < queue->sharded.lane_count; i++)
+        {
+            addStatsOf(queue->sharded.lanes[i], snapshot);
+        }
+    }
+    return true;
+#else
+    (void)queue;
+    return false;
+#endif
 }
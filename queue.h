@@ -1,11 +1,181 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <time.h>
+
+// Number of priorities accepted by enqueuePriority(), from 0, the priority of enqueue(), up to QUEUE_PRIORITY_LEVELS - 1, the most urgent.
+#define QUEUE_PRIORITY_LEVELS 8
+
+// Shape of the QueueStats.time_in_queue histogram: below QUEUE_LATENCY_SUB_BUCKETS nanoseconds each value has a bucket of its own, and each power of two after that
+// is split into QUEUE_LATENCY_SUB_BUCKETS equal steps, so that a bucket is never wider than a quarter of its floor; the last bucket also holds every longer stay.
+#define QUEUE_LATENCY_SUB_BUCKET_BITS 2
+#define QUEUE_LATENCY_SUB_BUCKETS (1 << QUEUE_LATENCY_SUB_BUCKET_BITS)
+#define QUEUE_LATENCY_BUCKETS 128
+
+// Storage strategies selectable through QueueOptions.backend.
+enum QueueBackend
+{
+    // Unbounded linked list of pooled elements guarded by a single mutex.
+    QUEUE_BACKEND_LIST,
+    // Bounded lock-free ring of sequence-numbered slots; producers wait for room when it is full.
+    QUEUE_BACKEND_RING,
+    // Unbounded lock-free Michael-Scott list whose elements are reclaimed through hazard pointers.
+    QUEUE_BACKEND_LOCK_FREE_LIST,
+    // Several list lanes, each with its own lock; threads produce into their own lane and consume from it first, stealing from the others when it runs dry.
+    // Items keep their FIFO order within a lane only.
+    QUEUE_BACKEND_SHARDED,
+    // Bounded wait-free ring for one producer and one consumer, which only take the lock to block on a full or empty ring.
+    // The caller guarantees that no two threads ever enqueue, nor ever dequeue, at the same time.
+    QUEUE_BACKEND_SPSC_RING,
+    // Unbounded list that any number of producers append to with a single atomic exchange, drained by one consumer that only takes the lock to block on it.
+    // The caller guarantees that no two threads ever dequeue at the same time.
+    QUEUE_BACKEND_MPSC_LIST,
+    // Bounded lock-free ring of fixed-size records kept in a memory-mapped file, so that whatever was queued outlives the process: enqueue copies record_size bytes
+    // from the item into the file and dequeue returns a pointer to the copy there, which stays valid until the caller hands it back with releaseRecord().
+    // A queue opened on the file again delivers, in order, every record that was not released, including those dequeued but not released yet; one queue uses a file at a time.
+    QUEUE_BACKEND_SEGMENT,
+    // The segment's ring of records laid out in a shm_open() region rather than a file, so that queues in different processes attached to a region of the same name
+    // are one queue; records are copied in and released as with the segment backend. While the ring is neither full nor empty, neither side makes a system call.
+    // Blocked threads sleep on words in the region, and are not served in the order they blocked. size() and visited() count the items of every process,
+    // and the notification descriptor only those enqueued by its own. The first queue attached creates the region and the last one to be destroyed removes it.
+    QUEUE_BACKEND_SHARED_MEMORY,
+};
+
+// Tunables accepted by initQueueWithOptions(); a zero-initialized struct reproduces initQueue().
+struct QueueOptions
+{
+    // Number of data elements allocated up front so that enqueue() does not reach the heap until the reservation is exhausted.
+    size_t reserved_elements;
+    enum QueueBackend backend;
+    // Number of slots of the ring backends, and of records the segment and shared memory backends hold, rounded up to a power of two; 0 selects their default.
+    // With the list backend, the most items the queue holds before enqueue() blocks; 0 leaves it unbounded. The lock-free lists are always unbounded.
+    size_t capacity;
+    // Upper bound on the number of polls a consumer spends waiting for an item before it parks; 0 parks straight away.
+    // The budget actually spent adapts between a small floor and this bound according to how often spinning paid off.
+    unsigned spin_limit;
+    // With the list backend, give each item straight to the oldest blocked consumer, bypassing the element list whenever a consumer is waiting.
+    bool direct_hand_off;
+    // With the list and sharded backends, prefetch the element after the new head and the new head's payload while the lock is held, so that a consumer working through a backlog finds both in cache.
+    bool prefetch_next;
+    // Number of lanes of the sharded backend; 0 gives one per online processor.
+    // In a QUEUE_NUMA_PLACEMENT build the lanes are dealt out to the NUMA nodes in turn, and threads use, and drain first, the lanes of their own node.
+    size_t lanes;
+    // Give the queue a descriptor an event loop can poll for incoming items, as returned by queueNotificationDescriptor().
+    bool notification_descriptor;
+    // With the segment backend, the file holding the records, created if missing and started afresh if it was laid out for another record size or capacity.
+    const char *segment_path;
+    // With the segment and shared memory backends, the number of bytes copied from each item.
+    size_t record_size;
+    // With the segment backend, the number of enqueues between two syncs of the file to disk, made by the enqueue that completes the count; 0 leaves the write-back to the system.
+    // A record is safe from a process crash as soon as it is enqueued, and from a system crash once a sync after it has returned. Destroying the queue always syncs.
+    size_t sync_every;
+    // With the shared memory backend, the name of the region as shm_open() takes it: a slash followed by a name without slashes.
+    // Every queue attached to the region passes the same capacity and record_size.
+    const char *shared_name;
+};
+
+// Storage a caller embeds in its own struct so that enqueueIntrusive() can link the struct into the queue in place of an element allocated for it.
+// Its contents belong to the queue from enqueueIntrusive() until a dequeue hands the link back, and must not be touched in between.
+struct QueueLink
+{
+    void *reserved[4];
+};
+
+// Recovers the struct a dequeued QueueLink is embedded in, from the type of that struct and the name of its link member.
+#define QUEUE_LINK_CONTAINER(link, type, member) ((type *)(void *)((char *)(link) - offsetof(type, member)))
+
+// Opaque handle to an independent queue instance; the functions without a handle operate on a built-in default instance.
+struct Queue;
+
+// Snapshot of the hot-path statistics, only recorded when queue.c is compiled with QUEUE_STATS; like the other counters, it is exact once the queue is quiescent.
+struct QueueStats
+{
+    // Acquisitions of the queue lock, and how many of them found it held by another thread.
+    unsigned long lock_acquisitions;
+    unsigned long lock_contentions;
+    // Times a consumer blocked, times it was woken, and wakeups that found no item for it.
+    unsigned long parks;
+    unsigned long wakeups;
+    unsigned long spurious_wakeups;
+    // Most items held at once; for the sharded backend, by its deepest lane.
+    size_t max_depth;
+    // Items whose time in the queue, measured on a monotonic clock where one is available, falls between latencyBucketFloor(i) and latencyBucketFloor(i + 1) nanoseconds.
+    unsigned long time_in_queue[QUEUE_LATENCY_BUCKETS];
+};
+
 void initQueue(void);
+// Returns false if the backend cannot be set up, such as a segment file that cannot be opened, grown or mapped. The queue is then left as if destroyed:
+// calls on it return at once, and destroyQueue() does nothing.
+bool initQueueWithOptions(const struct QueueOptions *options);
+// Closes the queue, then waits until every thread inside a call on it has left before releasing it, so it must not be called from one of its continuations.
+// Until the queue is initialized again, calls on it return at once, as on a closed queue with nothing left.
 void destroyQueue(void);
+// Refuses further items and wakes every blocked thread at once. Consumers still drain what is queued, after which dequeue() returns NULL and the other dequeues
+// return false or 0 without blocking; producers blocked for room give up, so tryEnqueue() and enqueueTimed() return false and enqueue() and enqueueBatch() drop the item.
+// Items enqueued concurrently with closing may still be accepted, and stay available to consumers.
+void closeQueue(void);
 void enqueue(void*);
+bool tryEnqueue(void*);
+// Like enqueue(), but lets the item overtake every item of lower priority; items of equal priority stay in FIFO order.
+void enqueuePriority(void *data, int priority);
+// Like enqueue(link), but without allocating anything: the list, sharded and MPSC list backends chain the item through the link itself and the rings store it as is.
+// Dequeues return the link's address. Only the lock-free list still wraps it in an element of its own, since its hazard pointers may hold an element past its dequeue.
+void enqueueIntrusive(struct QueueLink *link);
+// Like enqueue(), but gives up and returns false once the absolute TIME_UTC deadline passes without room for the item.
+bool enqueueTimed(void *data, const struct timespec *deadline);
 void* dequeue(void);
 bool tryDequeue(void**);
+// Like dequeue(), but gives up and returns false once the absolute TIME_UTC deadline passes.
+bool dequeueTimed(void **dataPointer, const struct timespec *deadline);
+void enqueueBatch(void **items, size_t count);
+size_t dequeueBatch(void **items, size_t max_items);
+size_t tryDequeueBatch(void **items, size_t max_items);
+// Like dequeue(), but instead of blocking, has callback run with context and the item, or with NULL once the queue is closed with nothing left for it.
+// An item available straight away is passed on the calling thread before asyncDequeue() returns. Otherwise the continuation lines up with the blocked consumers,
+// keeping its place among them and counting towards waiting(), and runs on the thread that takes its item out for it: the producer of the item, a consumer leaving
+// the line ahead of it, or the one closing the queue. It runs without any lock held and may use the queue, even to line up again.
+// With the SPSC ring and MPSC list, the one consumer takes turns with whoever takes items out for its continuations until they have all run, so it may keep dequeuing meanwhile.
+// With the shared memory backend, whose producers may be in other processes, the calling thread waits for the item as dequeue() does instead.
+void asyncDequeue(void (*callback)(void *context, void *item), void *context);
+// The counters are read without stopping other threads. Each value is exact once the queue is quiescent; while operations are in flight it may
+// miss the ones still running, size() may briefly count an item that is being pushed, and visited() never goes backwards between two reads.
+// The tallies behind size() on the lock-free backends and behind visited() are striped per thread and summed here, so reading costs a few cache lines.
 size_t size(void);
 size_t waiting(void);
-size_t visited(void);
\ No newline at end of file
+size_t visited(void);
+// Fills snapshot and returns true in builds with QUEUE_STATS; otherwise zeroes it and returns false.
+bool stats(struct QueueStats *snapshot);
+// Descriptor that polls readable once items arrive, or -1 if the queue was created without QueueOptions.notification_descriptor or the system refused one.
+// It is an eventfd on Linux and the read end of a pipe elsewhere, and it belongs to the queue: callers poll it but never read or close it.
+// Producers make it readable only when it is not already, and it stays so until tryDequeue() or tryDequeueBatch() finds the queue empty, so an event loop
+// drains the queue with those until they report it empty before waiting on the descriptor again.
+// Closing the queue makes it readable for good, since finding the queue empty no longer rearms it.
+int notificationDescriptor(void);
+// With the segment and shared memory backends, hands a record returned by a dequeue back once the caller is done with it. Until then its slot stays taken, and after a restart it is delivered again.
+void releaseRecord(void *record);
+// Shortest time in the queue, in nanoseconds, counted by bucket i of QueueStats.time_in_queue.
+uint64_t latencyBucketFloor(size_t bucket);
+
+// Returns NULL where initQueueWithOptions() would return false.
+struct Queue *queueCreate(const struct QueueOptions *options);
+// Like destroyQueue(), but frees the handle as well, so calls racing with it must have started before it did.
+void queueDestroy(struct Queue *queue);
+void queueClose(struct Queue *queue);
+void queueEnqueue(struct Queue *queue, void *data);
+bool queueTryEnqueue(struct Queue *queue, void *data);
+void queueEnqueuePriority(struct Queue *queue, void *data, int priority);
+void queueEnqueueIntrusive(struct Queue *queue, struct QueueLink *link);
+bool queueEnqueueTimed(struct Queue *queue, void *data, const struct timespec *deadline);
+void *queueDequeue(struct Queue *queue);
+bool queueTryDequeue(struct Queue *queue, void **dataPointer);
+bool queueDequeueTimed(struct Queue *queue, void **dataPointer, const struct timespec *deadline);
+void queueEnqueueBatch(struct Queue *queue, void **items, size_t count);
+size_t queueDequeueBatch(struct Queue *queue, void **items, size_t max_items);
+size_t queueTryDequeueBatch(struct Queue *queue, void **items, size_t max_items);
+void queueAsyncDequeue(struct Queue *queue, void (*callback)(void *context, void *item), void *context);
+size_t queueSize(struct Queue *queue);
+size_t queueWaiting(struct Queue *queue);
+size_t queueVisited(struct Queue *queue);
+bool queueStats(struct Queue *queue, struct QueueStats *snapshot);
+int queueNotificationDescriptor(struct Queue *queue);
+void queueReleaseRecord(struct Queue *queue, void *record);
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
 #include "queue.c"
 
 #define NUM_OPERATIONS 10
@@ -531,6 +533,1469 @@ void test_mixed_operations()
     printf("mixed operations test passed.\n");
 }
 
+void test_reserved_element_pool()
+{
+    printf("=== Testing reserved element pool ===\n");
+
+    initQueueWithOptions(&(struct QueueOptions){.reserved_elements = 8});
+
+    int items[MAX_SIZE];
+    // Cycle well past the reservation so that elements are recycled and fresh slabs are carved
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            items[i] = round * MAX_SIZE + i;
+            enqueue(&items[i]);
+        }
+        for (int i = 0; i < MAX_SIZE; i++)
+        {
+            int *item = (int *)dequeue();
+            assert(*item == round * MAX_SIZE + i);
+        }
+    }
+
+    assert(size() == 0);
+    assert(visited() == 3 * MAX_SIZE);
+
+    destroyQueue();
+
+    printf("reserved element pool test passed.\n");
+}
+
+// Runs the same FIFO and blocking hand-off checks against any backend
+void check_backend(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+
+    int items[] = {1, 2, 3, 4, 5};
+    size_t num_items = sizeof(items) / sizeof(items[0]);
+    void *item;
+    assert(!tryDequeue(&item));
+
+    for (size_t i = 0; i < num_items; i++)
+    {
+        enqueue(&items[i]);
+    }
+    assert(size() == num_items);
+    for (size_t i = 0; i < num_items; i++)
+    {
+        assert(tryDequeue(&item));
+        assert(*(int *)item == items[i]);
+    }
+    assert(!tryDequeue(&item));
+
+    // Park consumers first, then let producers hand items over
+    thrd_t enqueueThreads[NUM_THREADS_CONC];
+    thrd_t dequeueThreads[NUM_THREADS_CONC];
+    for (int i = 0; i < NUM_THREADS_CONC; i++)
+    {
+        thrd_create(&dequeueThreads[i], dequeue_thread, NULL);
+    }
+    for (int i = 0; i < NUM_THREADS_CONC; i++)
+    {
+        thrd_create(&enqueueThreads[i], enqueue_thread, NULL);
+    }
+    for (int i = 0; i < NUM_THREADS_CONC; i++)
+    {
+        thrd_join(enqueueThreads[i], NULL);
+    }
+    for (int i = 0; i < NUM_THREADS_CONC; i++)
+    {
+        thrd_join(dequeueThreads[i], NULL);
+    }
+
+    assert(size() == 0);
+    assert(visited() == num_items + NUM_THREADS_CONC);
+    assert(waiting() == 0);
+
+    destroyQueue();
+}
+
+void test_ring_backend()
+{
+    printf("=== Testing ring backend ===\n");
+
+    check_backend(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING, .capacity = 16});
+
+    printf("ring backend test passed.\n");
+}
+
+void test_lock_free_list_backend()
+{
+    printf("=== Testing lock-free list backend ===\n");
+
+    check_backend(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+
+    printf("lock-free list backend test passed.\n");
+}
+
+int batch_consumer_thread(void *arg)
+{
+    int *consumed = (int *)arg;
+    void *batch[8];
+    while (*consumed < MAX_SIZE / NUM_OPERATIONS)
+    {
+        int remaining = MAX_SIZE / NUM_OPERATIONS - *consumed;
+        *consumed += dequeueBatch(batch, remaining < 8 ? remaining : 8);
+    }
+    return 0;
+}
+
+// Checks batch ordering and that batch consumers are woken for spliced chains
+void check_batch_operations(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+
+    int items[MAX_SIZE];
+    void *pointers[MAX_SIZE];
+    for (int i = 0; i < MAX_SIZE; i++)
+    {
+        items[i] = i;
+        pointers[i] = &items[i];
+    }
+    enqueueBatch(pointers, MAX_SIZE / 2);
+    assert(size() == MAX_SIZE / 2);
+
+    void *out[MAX_SIZE];
+    size_t taken = tryDequeueBatch(out, 30);
+    assert(taken == 30);
+    taken += dequeueBatch(out + taken, MAX_SIZE);
+    assert(taken == MAX_SIZE / 2);
+    for (size_t i = 0; i < taken; i++)
+    {
+        assert(*(int *)out[i] == (int)i);
+    }
+    assert(tryDequeueBatch(out, MAX_SIZE) == 0);
+
+    // Park batch consumers, then feed them full bursts
+    thrd_t consumers[NUM_OPERATIONS];
+    int consumed[NUM_OPERATIONS] = {0};
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_create(&consumers[i], batch_consumer_thread, &consumed[i]);
+    }
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        enqueueBatch(pointers + i * (MAX_SIZE / NUM_OPERATIONS), MAX_SIZE / NUM_OPERATIONS);
+    }
+    for (int i = 0; i < NUM_OPERATIONS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        assert(consumed[i] == MAX_SIZE / NUM_OPERATIONS);
+    }
+
+    assert(size() == 0);
+    assert(visited() == MAX_SIZE / 2 + MAX_SIZE);
+    assert(waiting() == 0);
+
+    destroyQueue();
+}
+
+void test_batch_operations()
+{
+    printf("=== Testing batch operations ===\n");
+
+    check_batch_operations(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    check_batch_operations(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING, .capacity = MAX_SIZE});
+    check_batch_operations(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+
+    printf("batch operations test passed.\n");
+}
+
+int instance_consumer_thread(void *arg)
+{
+    struct Queue *queue = (struct Queue *)arg;
+    return *(int *)queueDequeue(queue);
+}
+
+void test_multiple_instances()
+{
+    printf("=== Testing multiple queue instances ===\n");
+
+    initQueue();
+    struct Queue *first = queueCreate(NULL);
+    struct Queue *second = queueCreate(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING});
+
+    int items[] = {1, 2, 3, 4, 5, 6};
+    enqueue(&items[0]);
+    queueEnqueue(first, &items[1]);
+    queueEnqueue(first, &items[2]);
+    queueEnqueue(second, &items[3]);
+
+    // Each instance keeps its own items and counters
+    assert(size() == 1);
+    assert(queueSize(first) == 2);
+    assert(queueSize(second) == 1);
+    assert(*(int *)queueDequeue(first) == items[1]);
+    assert(*(int *)queueDequeue(second) == items[3]);
+    assert(*(int *)dequeue() == items[0]);
+    assert(queueVisited(first) == 1);
+    assert(visited() == 1);
+
+    // A consumer blocked on one instance is only woken by producers of that instance
+    thrd_t consumer;
+    int value;
+    thrd_create(&consumer, instance_consumer_thread, second);
+    while (queueWaiting(second) == 0)
+    {
+        thrd_yield();
+    }
+    queueEnqueue(first, &items[4]);
+    assert(queueWaiting(second) == 1);
+    queueEnqueue(second, &items[5]);
+    thrd_join(consumer, &value);
+    assert(value == items[5]);
+
+    // Destroying one instance leaves the elements of the others intact
+    queueDestroy(second);
+    void *item;
+    assert(queueTryDequeue(first, &item) && *(int *)item == items[2]);
+    assert(queueTryDequeue(first, &item) && *(int *)item == items[4]);
+    assert(!queueTryDequeue(first, &item));
+
+    queueDestroy(first);
+    destroyQueue();
+
+    printf("multiple queue instances test passed.\n");
+}
+
+int timed_consumer_thread(void *arg)
+{
+    // A NULL slot means wait forever, anything else is a deadline 100 milliseconds from now
+    void **slot = (void **)arg;
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 0.1 * SECOND_IN_NANOSECONDS;
+    if (deadline.tv_nsec >= SECOND_IN_NANOSECONDS)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= SECOND_IN_NANOSECONDS;
+    }
+    return dequeueTimed(slot, *slot == NULL ? NULL : &deadline) ? 1 : 0;
+}
+
+void check_dequeue_timed(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+
+    // Time out on an empty queue without leaving a waiter behind
+    int timeout_marker = 0;
+    void *slots[3] = {&timeout_marker, NULL, NULL};
+    thrd_t consumers[3];
+    int results[3];
+    thrd_create(&consumers[0], timed_consumer_thread, &slots[0]);
+    thrd_join(consumers[0], &results[0]);
+    assert(results[0] == 0);
+    assert(waiting() == 0);
+
+    // A waiter that times out in the middle of the line must not cost the later waiters their turn
+    slots[0] = &timeout_marker;
+    for (int i = 0; i < 3; i++)
+    {
+        thrd_create(&consumers[i], timed_consumer_thread, &slots[i]);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.02 * SECOND_IN_NANOSECONDS}, NULL);
+    }
+    thrd_join(consumers[0], &results[0]);
+    assert(results[0] == 0);
+    assert(waiting() == 2);
+
+    int items[] = {1, 2};
+    enqueue(&items[0]);
+    enqueue(&items[1]);
+    thrd_join(consumers[1], &results[1]);
+    thrd_join(consumers[2], &results[2]);
+    assert(results[1] == 1 && results[2] == 1);
+    assert(*(int *)slots[1] == items[0]);
+    assert(*(int *)slots[2] == items[1]);
+    assert(waiting() == 0);
+
+    destroyQueue();
+}
+
+void test_dequeue_timed()
+{
+    printf("=== Testing timed dequeue ===\n");
+
+    check_dequeue_timed(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    check_dequeue_timed(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING});
+    check_dequeue_timed(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+
+    printf("timed dequeue test passed.\n");
+}
+
+void test_spin_then_park()
+{
+    printf("=== Testing spin-then-park dequeue ===\n");
+
+    // Spinning consumers must still park once their budget runs out and keep the blocking hand-off intact
+    check_backend(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .spin_limit = 4096});
+    check_backend(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING, .spin_limit = 4096});
+    check_backend(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST, .spin_limit = 4096});
+    check_dequeue_timed(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .spin_limit = 4096});
+
+    printf("spin-then-park dequeue test passed.\n");
+}
+
+void test_claimed_items()
+{
+    printf("=== Testing items claimed by waiters ===\n");
+
+    initQueue();
+    thrd_t consumer;
+    int value;
+    thrd_create(&consumer, instance_consumer_thread, &defaultQueue);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+
+    // The producer promises the item to the parked consumer before unlocking, so a barging thread cannot take it
+    int items[] = {1, 2};
+    void *item;
+    enqueue(&items[0]);
+    assert(!tryDequeue(&item));
+    thrd_join(consumer, &value);
+    assert(value == items[0]);
+
+    // Once nobody is waiting, new items are free for the taking again
+    enqueue(&items[1]);
+    assert(tryDequeue(&item) && *(int *)item == items[1]);
+    assert(size() == 0 && waiting() == 0);
+
+    destroyQueue();
+
+    printf("claimed items test passed.\n");
+}
+
+void test_direct_hand_off()
+{
+    printf("=== Testing direct hand-off ===\n");
+
+    struct QueueOptions options = {.backend = QUEUE_BACKEND_LIST, .direct_hand_off = true};
+    check_backend(&options);
+    check_batch_operations(&options);
+    check_dequeue_timed(&options);
+
+    // An item given to a parked consumer never shows up in the queue
+    initQueueWithOptions(&options);
+    thrd_t consumer;
+    int value;
+    thrd_create(&consumer, instance_consumer_thread, &defaultQueue);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    int items[] = {1, 2};
+    void *item;
+    enqueue(&items[0]);
+    assert(size() == 0 && visited() == 1);
+    assert(!tryDequeue(&item));
+    thrd_join(consumer, &value);
+    assert(value == items[0]);
+
+    // Without a waiter the item is queued as usual
+    enqueue(&items[1]);
+    assert(size() == 1);
+    assert(*(int *)dequeue() == items[1]);
+    destroyQueue();
+
+    printf("direct hand-off test passed.\n");
+}
+
+int blocked_producer_thread(void *arg)
+{
+    enqueue(arg);
+    return 0;
+}
+
+int timed_producer_thread(void *arg)
+{
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 0.1 * SECOND_IN_NANOSECONDS;
+    if (deadline.tv_nsec >= SECOND_IN_NANOSECONDS)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= SECOND_IN_NANOSECONDS;
+    }
+    return enqueueTimed(arg, &deadline) ? 1 : 0;
+}
+
+#define BOUNDED_ITEMS_PER_THREAD 1000
+#define BOUNDED_THREADS 4
+
+int bounded_producer_thread(void *arg)
+{
+    (void)arg;
+    // Alternate single items with small batches, which a bounded list has to split across slots
+    for (uintptr_t i = 1; i <= BOUNDED_ITEMS_PER_THREAD; i += 4)
+    {
+        void *batch[3] = {(void *)(i + 1), (void *)(i + 2), (void *)(i + 3)};
+        enqueue((void *)i);
+        enqueueBatch(batch, 3);
+    }
+    return 0;
+}
+
+int bounded_consumer_thread(void *arg)
+{
+    uintptr_t *sum = (uintptr_t *)arg;
+    for (int i = 0; i < BOUNDED_ITEMS_PER_THREAD; i++)
+    {
+        *sum += (uintptr_t)dequeue();
+    }
+    return 0;
+}
+
+void check_bounded_capacity(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+
+    // A full queue refuses new items instead of growing
+    int items[] = {1, 2, 3, 4, 5};
+    assert(tryEnqueue(&items[0]));
+    assert(tryEnqueue(&items[1]));
+    assert(!tryEnqueue(&items[2]));
+    thrd_t producers[2];
+    int result;
+    thrd_create(&producers[0], timed_producer_thread, &items[2]);
+    thrd_join(producers[0], &result);
+    assert(result == 0);
+    assert(size() == 2);
+
+    // Blocked producers get in once consumers make room, in the order they arrived
+    thrd_create(&producers[0], blocked_producer_thread, &items[3]);
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.02 * SECOND_IN_NANOSECONDS}, NULL);
+    thrd_create(&producers[1], blocked_producer_thread, &items[4]);
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.02 * SECOND_IN_NANOSECONDS}, NULL);
+    assert(size() == 2);
+    assert(*(int *)dequeue() == items[0]);
+    assert(*(int *)dequeue() == items[1]);
+    thrd_join(producers[0], NULL);
+    thrd_join(producers[1], NULL);
+    assert(*(int *)dequeue() == items[3]);
+    assert(*(int *)dequeue() == items[4]);
+    assert(size() == 0);
+
+    // Producers outnumbering the slots must neither lose items nor deadlock
+    thrd_t workers[2 * BOUNDED_THREADS];
+    uintptr_t sums[BOUNDED_THREADS] = {0};
+    for (int i = 0; i < BOUNDED_THREADS; i++)
+    {
+        thrd_create(&workers[i], bounded_consumer_thread, &sums[i]);
+        thrd_create(&workers[BOUNDED_THREADS + i], bounded_producer_thread, NULL);
+    }
+    uintptr_t total = 0;
+    for (int i = 0; i < 2 * BOUNDED_THREADS; i++)
+    {
+        thrd_join(workers[i], NULL);
+    }
+    for (int i = 0; i < BOUNDED_THREADS; i++)
+    {
+        total += sums[i];
+    }
+    assert(total == (uintptr_t)BOUNDED_THREADS * BOUNDED_ITEMS_PER_THREAD * (BOUNDED_ITEMS_PER_THREAD + 1) / 2);
+    assert(size() == 0 && waiting() == 0);
+
+    destroyQueue();
+}
+
+void test_bounded_capacity()
+{
+    printf("=== Testing bounded capacity ===\n");
+
+    check_bounded_capacity(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .capacity = 2});
+    check_bounded_capacity(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .capacity = 2, .direct_hand_off = true});
+    check_bounded_capacity(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING, .capacity = 2});
+
+    printf("bounded capacity test passed.\n");
+}
+
+int lane_producer_thread(void *arg)
+{
+    int *items = (int *)arg;
+    for (int i = 0; i < 5; i++)
+    {
+        enqueue(&items[i]);
+    }
+    return 0;
+}
+
+void test_sharded_backend()
+{
+    printf("=== Testing sharded backend ===\n");
+
+    struct QueueOptions options = {.backend = QUEUE_BACKEND_SHARDED, .lanes = 4};
+    check_backend(&options);
+    check_batch_operations(&options);
+    check_dequeue_timed(&options);
+
+    // Items produced on another thread's lane are stolen once the local lane is empty, and the counters stay global
+    initQueueWithOptions(&options);
+    int items[] = {1, 2, 3, 4, 5};
+    thrd_t producer;
+    thrd_create(&producer, lane_producer_thread, items);
+    thrd_join(producer, NULL);
+    assert(size() == 5);
+    void *item;
+    for (int i = 0; i < 5; i++)
+    {
+        assert(tryDequeue(&item) && *(int *)item == items[i]);
+    }
+    assert(!tryDequeue(&item));
+    assert(size() == 0 && visited() == 5);
+    destroyQueue();
+
+    printf("sharded backend test passed.\n");
+}
+
+void test_numa_lane_preference()
+{
+    printf("=== Testing NUMA lane preference ===\n");
+
+    // Pretend the lanes are spread over two nodes: even lanes on node 0, odd lanes on node 1
+    struct Queue *queue = queueCreate(&(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED, .lanes = 4});
+    queue->sharded.node_count = 2;
+    size_t node = fetchThreadNode() % 2;
+    size_t home = fetchThreadLane(queue);
+    assert(home % 2 == node);
+
+    // An item on the other local lane is taken before an older one on a remote lane
+    int items[] = {1, 2};
+    queueEnqueue(queue->sharded.lanes[(home + 1) % 4], &items[0]);
+    queueEnqueue(queue->sharded.lanes[(home + 2) % 4], &items[1]);
+    void *item;
+    assert(queueTryDequeue(queue, &item) && item == &items[1]);
+    assert(queueTryDequeue(queue, &item) && item == &items[0]);
+    assert(!queueTryDequeue(queue, &item));
+    queueDestroy(queue);
+
+    // With fewer lanes than nodes every thread still lands on a real lane
+    queue = queueCreate(&(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED, .lanes = 1});
+    queue->sharded.node_count = 2;
+    assert(fetchThreadLane(queue) == 0);
+    queueEnqueue(queue, &items[0]);
+    assert(queueTryDequeue(queue, &item) && item == &items[0]);
+    queueDestroy(queue);
+
+    printf("NUMA lane preference test passed.\n");
+}
+
+void test_prefetch_next()
+{
+    printf("=== Testing prefetch of the next element ===\n");
+
+    // Prefetching changes nothing a caller can observe, whatever the queued pointers point at
+    enum QueueBackend backends[] = {QUEUE_BACKEND_LIST, QUEUE_BACKEND_SHARDED};
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        struct QueueOptions options = {.backend = backends[b], .lanes = 2, .prefetch_next = true};
+        check_backend(&options);
+        check_batch_operations(&options);
+        check_dequeue_timed(&options);
+    }
+
+    printf("prefetch test passed.\n");
+}
+
+void check_priority_order(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+    int items[] = {1, 2, 3, 4, 5, 6, 7};
+    void *item;
+
+    // Higher priorities overtake lower ones, equal priorities keep FIFO order and out-of-range priorities are clamped
+    enqueue(&items[0]);
+    enqueuePriority(&items[1], 3);
+    enqueuePriority(&items[2], 3);
+    enqueuePriority(&items[3], 1);
+    enqueue(&items[4]);
+    enqueuePriority(&items[5], QUEUE_PRIORITY_LEVELS - 1);
+    enqueuePriority(&items[6], 100);
+    assert(size() == 7);
+    int expected[] = {6, 7, 2, 3, 4, 1, 5};
+    for (int i = 0; i < 3; i++)
+    {
+        assert(*(int *)dequeue() == expected[i]);
+    }
+
+    // Refill a run that was partly drained and one that was emptied
+    enqueuePriority(&items[1], 3);
+    enqueuePriority(&items[5], QUEUE_PRIORITY_LEVELS - 1);
+    enqueuePriority(&items[3], -5);
+    int refilled[] = {6, 3, 2, 4, 1, 5, 4};
+    for (int i = 0; i < 7; i++)
+    {
+        assert(tryDequeue(&item) && *(int *)item == refilled[i]);
+    }
+    assert(!tryDequeue(&item));
+    assert(size() == 0 && visited() == 10);
+    destroyQueue();
+}
+
+void test_priority()
+{
+    printf("=== Testing priority enqueue ===\n");
+
+    check_priority_order(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    check_priority_order(&(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED, .lanes = 4});
+
+    // A parked consumer is woken by a priority item like by any other
+    struct QueueOptions options = {.backend = QUEUE_BACKEND_LIST};
+    initQueueWithOptions(&options);
+    thrd_t consumer;
+    int value;
+    int item = 42;
+    thrd_create(&consumer, instance_consumer_thread, &defaultQueue);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueuePriority(&item, 5);
+    thrd_join(consumer, &value);
+    assert(value == item);
+    destroyQueue();
+
+    // The lock-free backends keep priority items in plain FIFO order
+    options.backend = QUEUE_BACKEND_RING;
+    initQueueWithOptions(&options);
+    int items[] = {1, 2};
+    enqueue(&items[0]);
+    enqueuePriority(&items[1], 7);
+    assert(*(int *)dequeue() == items[0] && *(int *)dequeue() == items[1]);
+    destroyQueue();
+
+    printf("priority enqueue test passed.\n");
+}
+
+void test_stats()
+{
+    printf("=== Testing stats snapshot ===\n");
+
+    struct QueueStats snapshot;
+    // Every stay falls into the bucket whose range contains it, and no bucket is wider than a quarter of its floor
+    for (uint64_t nanoseconds = 0; nanoseconds < 100000; nanoseconds += 1 + nanoseconds / 64)
+    {
+        size_t bucket = fetchLatencyBucket(nanoseconds);
+        assert(latencyBucketFloor(bucket) <= nanoseconds && nanoseconds < latencyBucketFloor(bucket + 1));
+    }
+    for (size_t bucket = QUEUE_LATENCY_SUB_BUCKETS; bucket < QUEUE_LATENCY_BUCKETS; bucket++)
+    {
+        assert(fetchLatencyBucket(latencyBucketFloor(bucket)) == bucket);
+        assert(latencyBucketFloor(bucket + 1) - latencyBucketFloor(bucket) <= latencyBucketFloor(bucket) / 4);
+    }
+    assert(fetchLatencyBucket(UINT64_MAX) == QUEUE_LATENCY_BUCKETS - 1);
+#ifdef QUEUE_STATS
+    enum QueueBackend backends[] = {QUEUE_BACKEND_LIST, QUEUE_BACKEND_RING, QUEUE_BACKEND_LOCK_FREE_LIST, QUEUE_BACKEND_SHARDED, QUEUE_BACKEND_SPSC_RING,
+                                    QUEUE_BACKEND_MPSC_LIST};
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        struct QueueOptions options = {.backend = backends[b]};
+        initQueueWithOptions(&options);
+        int items[] = {1, 2, 3};
+        for (int i = 0; i < 3; i++)
+        {
+            enqueue(&items[i]);
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            dequeue();
+        }
+        // Every item that left the queue lands in exactly one time-in-queue bucket
+        assert(stats(&snapshot));
+        unsigned long timed = 0;
+        for (int i = 0; i < QUEUE_LATENCY_BUCKETS; i++)
+        {
+            timed += snapshot.time_in_queue[i];
+        }
+        assert(timed == 3 && snapshot.max_depth == 3);
+
+        // A consumer that blocks is counted as a park and, once fed, as a wakeup
+        thrd_t consumer;
+        int value;
+        thrd_create(&consumer, instance_consumer_thread, &defaultQueue);
+        while (waiting() == 0)
+        {
+            thrd_yield();
+        }
+        enqueue(&items[0]);
+        thrd_join(consumer, &value);
+        assert(value == items[0]);
+        assert(stats(&snapshot));
+        assert(snapshot.parks == 1 && snapshot.wakeups >= 1 && snapshot.spurious_wakeups == snapshot.wakeups - 1);
+        assert(snapshot.lock_acquisitions > 0 && snapshot.lock_contentions <= snapshot.lock_acquisitions);
+        destroyQueue();
+    }
+#else
+    // Without QUEUE_STATS nothing is recorded and the snapshot says so
+    initQueue();
+    enqueue(&snapshot);
+    dequeue();
+    snapshot.parks = 1;
+    assert(!stats(&snapshot) && snapshot.parks == 0);
+    destroyQueue();
+#endif
+
+    printf("stats snapshot test passed.\n");
+}
+
+#define CLOSING_CONSUMERS 8
+
+int draining_consumer_thread(void *arg)
+{
+    // Keep taking items until the closed queue runs dry
+    int *taken = (int *)arg;
+    void *item;
+    while (dequeueTimed(&item, NULL))
+    {
+        (*taken)++;
+    }
+    assert(dequeue() == NULL);
+    return 0;
+}
+
+int parked_consumer_thread(void *arg)
+{
+    // Block once and leave
+    (void)arg;
+    void *item;
+    return dequeueTimed(&item, NULL) ? 1 : 0;
+}
+
+int closed_producer_thread(void *arg)
+{
+    return enqueueTimed(arg, NULL) ? 1 : 0;
+}
+
+void check_close_queue(const struct QueueOptions *options)
+{
+    // Items queued before closing are still handed out, then dequeues return at once
+    initQueueWithOptions(options);
+    int items[] = {1, 2, 3, 4, 5};
+    void *item;
+    for (int i = 0; i < 3; i++)
+    {
+        enqueue(&items[i]);
+    }
+    closeQueue();
+    assert(!tryEnqueue(&items[3]) && !enqueueTimed(&items[3], NULL));
+    enqueue(&items[3]);
+    enqueueBatch((void *[]){&items[3], &items[4]}, 2);
+    assert(size() == 3);
+    void *batch[2];
+    assert(dequeueBatch(batch, 2) == 2 && batch[0] == &items[0] && batch[1] == &items[1]);
+    assert(dequeue() == &items[2]);
+    assert(dequeue() == NULL && !dequeueTimed(&item, NULL) && dequeueBatch(batch, 2) == 0);
+    destroyQueue();
+
+    // Closing wakes every parked consumer in one go, after they have drained the queue
+    initQueueWithOptions(options);
+    thrd_t consumers[CLOSING_CONSUMERS];
+    int taken[CLOSING_CONSUMERS] = {0};
+    for (int i = 0; i < CLOSING_CONSUMERS; i++)
+    {
+        thrd_create(&consumers[i], draining_consumer_thread, &taken[i]);
+    }
+    while (waiting() < CLOSING_CONSUMERS)
+    {
+        thrd_yield();
+    }
+    for (int i = 0; i < 5; i++)
+    {
+        enqueue(&items[i]);
+    }
+    closeQueue();
+    int total = 0;
+    for (int i = 0; i < CLOSING_CONSUMERS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        total += taken[i];
+    }
+    assert(total == 5 && size() == 0 && waiting() == 0);
+    destroyQueue();
+
+    // Destroying a queue with parked consumers closes it first and waits for them to leave; the dequeues they retry afterwards find it destroyed and return
+    initQueueWithOptions(options);
+    for (int i = 0; i < CLOSING_CONSUMERS; i++)
+    {
+        taken[i] = 0;
+        thrd_create(&consumers[i], draining_consumer_thread, &taken[i]);
+    }
+    while (waiting() < CLOSING_CONSUMERS)
+    {
+        thrd_yield();
+    }
+    destroyQueue();
+    for (int i = 0; i < CLOSING_CONSUMERS; i++)
+    {
+        thrd_join(consumers[i], NULL);
+        assert(taken[i] == 0);
+    }
+}
+
+void test_close_queue()
+{
+    printf("=== Testing closeQueue ===\n");
+
+    check_close_queue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    check_close_queue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .direct_hand_off = true});
+    check_close_queue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .spin_limit = 2048});
+    check_close_queue(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING});
+    check_close_queue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+    check_close_queue(&(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED, .lanes = 4});
+
+    // Producers blocked on a full queue give up once it is closed
+    enum QueueBackend bounded[] = {QUEUE_BACKEND_LIST, QUEUE_BACKEND_RING};
+    for (size_t b = 0; b < sizeof(bounded) / sizeof(bounded[0]); b++)
+    {
+        struct QueueOptions options = {.backend = bounded[b], .capacity = 2};
+        initQueueWithOptions(&options);
+        int items[] = {1, 2, 3};
+        enqueue(&items[0]);
+        enqueue(&items[1]);
+        thrd_t producer;
+        int accepted;
+        thrd_create(&producer, closed_producer_thread, &items[2]);
+        thrd_sleep(&(const struct timespec){.tv_nsec = 0.02 * SECOND_IN_NANOSECONDS}, NULL);
+        closeQueue();
+        thrd_join(producer, &accepted);
+        assert(accepted == 0 && size() == 2);
+        destroyQueue();
+    }
+
+    printf("closeQueue test passed.\n");
+}
+
+#define SINGLE_CONSUMER_ITEMS 20000
+#define SINGLE_CONSUMER_PRODUCERS 4
+
+int sequenced_producer_thread(void *arg)
+{
+    // Each producer numbers its items so that the consumer can check they arrive in order
+    uintptr_t first = (uintptr_t)arg * SINGLE_CONSUMER_ITEMS + 1;
+    for (uintptr_t i = 0; i < SINGLE_CONSUMER_ITEMS; i++)
+    {
+        enqueue((void *)(first + i));
+    }
+    return 0;
+}
+
+void check_single_consumer(const struct QueueOptions *options, int producers)
+{
+    initQueueWithOptions(options);
+
+    // The one consumer blocks on the empty queue until the producer feeds it
+    int items[] = {1, 2, 3};
+    void *item;
+    assert(!tryDequeue(&item));
+    thrd_t consumer;
+    int value;
+    thrd_create(&consumer, instance_consumer_thread, &defaultQueue);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueue(&items[0]);
+    thrd_join(consumer, &value);
+    assert(value == items[0] && waiting() == 0);
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+    assert(size() == 2);
+    assert(dequeue() == &items[1] && dequeue() == &items[2]);
+    assert(!tryDequeue(&item));
+
+    // Every producer's items arrive complete and in the order it enqueued them, also across a ring that fills up
+    thrd_t producerThreads[SINGLE_CONSUMER_PRODUCERS];
+    uintptr_t expected[SINGLE_CONSUMER_PRODUCERS];
+    for (int i = 0; i < producers; i++)
+    {
+        expected[i] = (uintptr_t)i * SINGLE_CONSUMER_ITEMS + 1;
+        thrd_create(&producerThreads[i], sequenced_producer_thread, (void *)(uintptr_t)i);
+    }
+    for (int i = 0; i < producers * SINGLE_CONSUMER_ITEMS; i++)
+    {
+        uintptr_t number = (uintptr_t)dequeue();
+        size_t producer = (number - 1) / SINGLE_CONSUMER_ITEMS;
+        assert(number == expected[producer]);
+        expected[producer]++;
+    }
+    for (int i = 0; i < producers; i++)
+    {
+        thrd_join(producerThreads[i], NULL);
+    }
+    assert(size() == 0 && waiting() == 0);
+    assert(visited() == 3 + (size_t)producers * SINGLE_CONSUMER_ITEMS);
+
+    destroyQueue();
+}
+
+void test_single_consumer_backends()
+{
+    printf("=== Testing SPSC and MPSC backends ===\n");
+
+    check_single_consumer(&(struct QueueOptions){.backend = QUEUE_BACKEND_SPSC_RING, .capacity = 16}, 1);
+    check_single_consumer(&(struct QueueOptions){.backend = QUEUE_BACKEND_SPSC_RING, .capacity = 16, .spin_limit = 4096}, 1);
+    check_single_consumer(&(struct QueueOptions){.backend = QUEUE_BACKEND_MPSC_LIST}, SINGLE_CONSUMER_PRODUCERS);
+    check_single_consumer(&(struct QueueOptions){.backend = QUEUE_BACKEND_MPSC_LIST, .spin_limit = 4096}, SINGLE_CONSUMER_PRODUCERS);
+
+    // Both still honour closing, with the one consumer draining what is left
+    struct QueueOptions options[] = {{.backend = QUEUE_BACKEND_SPSC_RING, .capacity = 2}, {.backend = QUEUE_BACKEND_MPSC_LIST}};
+    for (size_t o = 0; o < sizeof(options) / sizeof(options[0]); o++)
+    {
+        initQueueWithOptions(&options[o]);
+        int items[] = {1, 2};
+        int taken = 0;
+        thrd_t consumer;
+        thrd_create(&consumer, draining_consumer_thread, &taken);
+        while (waiting() == 0)
+        {
+            thrd_yield();
+        }
+        enqueue(&items[0]);
+        enqueue(&items[1]);
+        closeQueue();
+        assert(!tryEnqueue(&items[0]));
+        thrd_join(consumer, NULL);
+        assert(taken == 2 && size() == 0);
+        destroyQueue();
+    }
+
+    printf("SPSC and MPSC backends test passed.\n");
+}
+
+// A caller-owned message carrying its own queue link
+struct LinkedMessage
+{
+    int value;
+    struct QueueLink link;
+};
+
+int intrusive_consumer_thread(void *arg)
+{
+    (void)arg;
+    return QUEUE_LINK_CONTAINER(dequeue(), struct LinkedMessage, link)->value;
+}
+
+void check_intrusive(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+
+    // Links come back out in order, and each leads back to the message it is embedded in
+    struct LinkedMessage messages[4] = {{.value = 1}, {.value = 2}, {.value = 3}, {.value = 4}};
+    for (int i = 0; i < 3; i++)
+    {
+        enqueueIntrusive(&messages[i].link);
+    }
+    enqueue(&messages[3]);
+    assert(size() == 4);
+    void *batch[2];
+    assert(tryDequeueBatch(batch, 2) == 2);
+    assert(batch[0] == &messages[0].link && batch[1] == &messages[1].link);
+    assert(QUEUE_LINK_CONTAINER(dequeue(), struct LinkedMessage, link) == &messages[2]);
+    assert(dequeue() == &messages[3]);
+
+    // A parked consumer is woken for an intrusive item like for any other
+    thrd_t consumer;
+    int value;
+    thrd_create(&consumer, intrusive_consumer_thread, NULL);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    enqueueIntrusive(&messages[0].link);
+    thrd_join(consumer, &value);
+    assert(value == messages[0].value && size() == 0);
+
+    destroyQueue();
+}
+
+void test_intrusive()
+{
+    printf("=== Testing intrusive enqueue ===\n");
+
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .direct_hand_off = true});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .capacity = 8});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED, .lanes = 4});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_SPSC_RING});
+    check_intrusive(&(struct QueueOptions){.backend = QUEUE_BACKEND_MPSC_LIST});
+
+    // Destroying a queue that still holds links gives them back to their owners, never to the element pool
+    initQueue();
+    struct LinkedMessage leftover[2];
+    enum QueueBackend backends[] = {QUEUE_BACKEND_LIST, QUEUE_BACKEND_MPSC_LIST};
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        struct Queue *queue = queueCreate(&(struct QueueOptions){.backend = backends[b]});
+        queueEnqueue(queue, &leftover[0]);
+        queueEnqueueIntrusive(queue, &leftover[0].link);
+        queueEnqueueIntrusive(queue, &leftover[1].link);
+        queueDestroy(queue);
+    }
+    for (struct DataElement *element = elementPools[fetchThreadNode()].free_list; element != NULL; element = element->next)
+    {
+        assert((void *)element != &leftover[0].link && (void *)element != &leftover[1].link);
+    }
+    destroyQueue();
+
+    printf("intrusive enqueue test passed.\n");
+}
+
+int readiness_producer_thread(void *arg)
+{
+    // Give the event loop time to block in poll() before the item arrives
+    thrd_sleep(&(const struct timespec){.tv_nsec = 0.02 * SECOND_IN_NANOSECONDS}, NULL);
+    enqueue(arg);
+    return 0;
+}
+
+bool is_readable(int descriptor, int timeout_milliseconds)
+{
+    struct pollfd poller = {.fd = descriptor, .events = POLLIN};
+    return poll(&poller, 1, timeout_milliseconds) == 1 && (poller.revents & POLLIN);
+}
+
+void check_notification_descriptor(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+    int descriptor = notificationDescriptor();
+    assert(descriptor >= 0 && !is_readable(descriptor, 0));
+
+    // A batch that is the first thing to arrive makes it readable on its own
+    int items[3];
+    void *item;
+    void *batch[4];
+    enqueueBatch((void *[]){&items[0], &items[1]}, 2);
+    assert(is_readable(descriptor, 0));
+    assert(tryDequeueBatch(batch, 4) == 2 && !is_readable(descriptor, 0));
+
+    // A burst of items makes the descriptor readable with a single write
+    enqueue(&items[0]);
+    enqueueBatch((void *[]){&items[1], &items[2]}, 2);
+    assert(is_readable(descriptor, 0));
+#ifdef __linux__
+    uint64_t writes;
+    assert(read(descriptor, &writes, sizeof(writes)) == sizeof(writes) && writes == 1);
+#endif
+    // Draining until the queue reports empty rearms it
+    assert(tryDequeueBatch(batch, 4) == 3);
+    assert(!is_readable(descriptor, 0));
+
+    // An event loop blocked on the descriptor wakes for the next item
+    thrd_t producer;
+    thrd_create(&producer, readiness_producer_thread, &items[0]);
+    assert(is_readable(descriptor, 5000));
+    thrd_join(producer, NULL);
+    assert(tryDequeue(&item) && item == &items[0]);
+    assert(!tryDequeue(&item) && !is_readable(descriptor, 0));
+
+    // Closing leaves it readable even after the queue has been drained
+    enqueue(&items[1]);
+    closeQueue();
+    assert(tryDequeue(&item) && !tryDequeue(&item));
+    assert(is_readable(descriptor, 0));
+
+    destroyQueue();
+}
+
+void test_notification_descriptor()
+{
+    printf("=== Testing notification descriptor ===\n");
+
+    // Without asking for one there is no descriptor
+    initQueue();
+    assert(notificationDescriptor() == -1);
+    destroyQueue();
+
+    enum QueueBackend backends[] = {QUEUE_BACKEND_LIST, QUEUE_BACKEND_RING, QUEUE_BACKEND_LOCK_FREE_LIST, QUEUE_BACKEND_SHARDED, QUEUE_BACKEND_SPSC_RING,
+                                    QUEUE_BACKEND_MPSC_LIST};
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+    {
+        check_notification_descriptor(&(struct QueueOptions){.backend = backends[b], .notification_descriptor = true});
+    }
+    check_notification_descriptor(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .direct_hand_off = true, .notification_descriptor = true});
+    check_notification_descriptor(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .capacity = 4, .notification_descriptor = true});
+
+    printf("notification descriptor test passed.\n");
+}
+
+#define SEGMENT_TEST_PATH "/tmp/queue-test.segment"
+#define SEGMENT_ITEMS_PER_PRODUCER 5000
+#define SEGMENT_THREADS 2
+
+struct SpoolRecord
+{
+    int producer;
+    int sequence;
+};
+
+static atomic_long spool_sequence_sum;
+
+int spool_producer_thread(void *arg)
+{
+    // The record is copied into the file, so one on the stack does for every enqueue
+    struct SpoolRecord record = {.producer = (int)(intptr_t)arg};
+    for (record.sequence = 1; record.sequence <= SEGMENT_ITEMS_PER_PRODUCER; record.sequence++)
+    {
+        enqueue(&record);
+    }
+    return 0;
+}
+
+int spool_consumer_thread(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < SEGMENT_ITEMS_PER_PRODUCER; i++)
+    {
+        const struct SpoolRecord *record = (const struct SpoolRecord *)dequeue();
+        assert(record->producer >= 0 && record->producer < SEGMENT_THREADS);
+        atomic_fetch_add(&spool_sequence_sum, record->sequence);
+        releaseRecord((void *)record);
+    }
+    return 0;
+}
+
+void test_segment_backend()
+{
+    printf("=== Testing segment backend ===\n");
+
+    remove(SEGMENT_TEST_PATH);
+    struct QueueOptions options = {.backend = QUEUE_BACKEND_SEGMENT, .capacity = 8, .segment_path = SEGMENT_TEST_PATH, .record_size = sizeof(struct SpoolRecord)};
+    struct SpoolRecord record = {0};
+    const struct SpoolRecord *dequeued;
+
+    // Records are copies, and a dequeued one stays in place until it is released
+    initQueueWithOptions(&options);
+    for (record.sequence = 1; record.sequence <= 5; record.sequence++)
+    {
+        enqueue(&record);
+    }
+    const struct SpoolRecord *first = (const struct SpoolRecord *)dequeue();
+    assert(first != &record && first->sequence == 1);
+    dequeued = (const struct SpoolRecord *)dequeue();
+    assert(dequeued->sequence == 2);
+    releaseRecord((void *)dequeued);
+    for (; record.sequence <= 8; record.sequence++)
+    {
+        enqueue(&record);
+    }
+    assert(first->sequence == 1 && size() == 6 && visited() == 2);
+    destroyQueue();
+
+    // Opening the file again delivers the unreleased record again, then resumes after the last dequeued one
+    initQueueWithOptions(&options);
+    assert(size() == 7);
+    dequeued = (const struct SpoolRecord *)dequeue();
+    assert(dequeued->sequence == 1);
+    releaseRecord((void *)dequeued);
+    for (int sequence = 3; sequence <= 8; sequence++)
+    {
+        dequeued = (const struct SpoolRecord *)dequeue();
+        assert(dequeued->sequence == sequence);
+        releaseRecord((void *)dequeued);
+    }
+    void *item;
+    assert(!tryDequeue(&item));
+    destroyQueue();
+
+    // A slot claimed by a producer that never filled it is closed up on recovery
+    initQueueWithOptions(&options);
+    assert(size() == 0);
+    atomic_fetch_add(&defaultQueue.segment.header->enqueue_position, 1);
+    record.sequence = 9;
+    enqueue(&record);
+    destroyQueue();
+    initQueueWithOptions(&options);
+    assert(size() == 1);
+    dequeued = (const struct SpoolRecord *)dequeue();
+    assert(dequeued->sequence == 9);
+    releaseRecord((void *)dequeued);
+    assert(!tryDequeue(&item));
+
+    // A full segment turns producers away until a release, not a dequeue, makes room
+    for (int i = 0; i < 8; i++)
+    {
+        assert(tryEnqueue(&record));
+    }
+    assert(!tryEnqueue(&record));
+    dequeued = (const struct SpoolRecord *)dequeue();
+    assert(!tryEnqueue(&record));
+    releaseRecord((void *)dequeued);
+    assert(tryEnqueue(&record));
+    destroyQueue();
+
+    // A segment file that cannot be opened fails the queue rather than the process, and leaves the default queue inert
+    struct QueueOptions unusable = options;
+    unusable.segment_path = "/nonexistent/directory/queue.segment";
+    assert(queueCreate(&unusable) == NULL);
+    unusable.segment_path = NULL;
+    assert(queueCreate(&unusable) == NULL);
+    assert(!initQueueWithOptions(&unusable));
+    assert(dequeue() == NULL && !tryEnqueue(&record) && size() == 0);
+    destroyQueue();
+
+    // A file laid out for another record size is started afresh
+    initQueueWithOptions(&(struct QueueOptions){.backend = QUEUE_BACKEND_SEGMENT, .capacity = 8, .segment_path = SEGMENT_TEST_PATH, .record_size = 2 * sizeof(struct SpoolRecord)});
+    assert(size() == 0 && !tryDequeue(&item));
+    destroyQueue();
+
+    // Producers and consumers racing through a small segment, syncing it as they go, lose and duplicate nothing
+    remove(SEGMENT_TEST_PATH);
+    options.sync_every = 1000;
+    initQueueWithOptions(&options);
+    atomic_store(&spool_sequence_sum, 0);
+    thrd_t producers[SEGMENT_THREADS];
+    thrd_t consumers[SEGMENT_THREADS];
+    for (int i = 0; i < SEGMENT_THREADS; i++)
+    {
+        thrd_create(&consumers[i], spool_consumer_thread, NULL);
+        thrd_create(&producers[i], spool_producer_thread, (void *)(intptr_t)i);
+    }
+    for (int i = 0; i < SEGMENT_THREADS; i++)
+    {
+        thrd_join(producers[i], NULL);
+        thrd_join(consumers[i], NULL);
+    }
+    assert(atomic_load(&spool_sequence_sum) == (long)SEGMENT_THREADS * SEGMENT_ITEMS_PER_PRODUCER * (SEGMENT_ITEMS_PER_PRODUCER + 1) / 2);
+    assert(size() == 0 && visited() == SEGMENT_THREADS * SEGMENT_ITEMS_PER_PRODUCER);
+    destroyQueue();
+    remove(SEGMENT_TEST_PATH);
+
+    printf("segment backend test passed.\n");
+}
+
+#define SHARED_TEST_NAME "/queue-test-shared"
+#define SHARED_ITEMS 20000
+
+void test_shared_memory_backend()
+{
+    printf("=== Testing shared memory backend ===\n");
+
+    shm_unlink(SHARED_TEST_NAME);
+    struct QueueOptions options = {.backend = QUEUE_BACKEND_SHARED_MEMORY, .capacity = 8, .shared_name = SHARED_TEST_NAME, .record_size = sizeof(struct SpoolRecord)};
+    struct SpoolRecord record = {0};
+    const struct SpoolRecord *dequeued;
+    void *item;
+
+    // A second queue attached under the same name sees the first one's records, and releasing them there makes room for the first one's producers
+    initQueueWithOptions(&options);
+    struct Queue *attached = queueCreate(&options);
+    for (record.sequence = 1; record.sequence <= 8; record.sequence++)
+    {
+        enqueue(&record);
+    }
+    assert(!tryEnqueue(&record) && queueSize(attached) == 8);
+    dequeued = (const struct SpoolRecord *)queueDequeue(attached);
+    assert(dequeued->sequence == 1 && visited() == 1);
+    queueReleaseRecord(attached, (void *)dequeued);
+    assert(tryEnqueue(&record));
+    for (int sequence = 2; sequence <= 9; sequence++)
+    {
+        dequeued = (const struct SpoolRecord *)dequeue();
+        assert(dequeued->sequence == sequence);
+        releaseRecord((void *)dequeued);
+    }
+    struct timespec deadline;
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += 1000000;
+    if (deadline.tv_nsec >= SECOND_IN_NANOSECONDS)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= SECOND_IN_NANOSECONDS;
+    }
+    assert(!queueDequeueTimed(attached, &item, &deadline));
+
+    // The region outlives the queue that created it, and goes with the last one
+    destroyQueue();
+    queueEnqueue(attached, &record);
+    assert(queueSize(attached) == 1);
+    queueDestroy(attached);
+    assert(shm_open(SHARED_TEST_NAME, O_RDWR, 0600) < 0 && errno == ENOENT);
+
+    // A region that cannot be opened or joined fails the queue instead of hanging it: no name, an invalid one, another geometry, or a creator that never sized it
+    struct QueueOptions unusable = options;
+    unusable.shared_name = NULL;
+    assert(queueCreate(&unusable) == NULL);
+    unusable.shared_name = "/queue-test/invalid";
+    assert(queueCreate(&unusable) == NULL);
+    struct Queue *creator = queueCreate(&options);
+    unusable = options;
+    unusable.capacity = 16;
+    assert(queueCreate(&unusable) == NULL);
+    queueDestroy(creator);
+    int stale = shm_open(SHARED_TEST_NAME, O_RDWR | O_CREAT | O_EXCL, 0600);
+    assert(stale >= 0 && queueCreate(&options) == NULL);
+    close(stale);
+    shm_unlink(SHARED_TEST_NAME);
+
+    // A producer process filling a small region and a consumer process draining it block on each other in turn, and the records arrive in order
+    initQueueWithOptions(&options);
+    pid_t producer = fork();
+    if (producer == 0)
+    {
+        struct Queue *queue = queueCreate(&options);
+        struct SpoolRecord produced = {.producer = 1};
+        for (produced.sequence = 1; produced.sequence <= SHARED_ITEMS; produced.sequence++)
+        {
+            queueEnqueue(queue, &produced);
+        }
+        queueDestroy(queue);
+        _exit(0);
+    }
+    for (int sequence = 1; sequence <= SHARED_ITEMS; sequence++)
+    {
+        dequeued = (const struct SpoolRecord *)dequeue();
+        assert(dequeued->producer == 1 && dequeued->sequence == sequence);
+        releaseRecord((void *)dequeued);
+    }
+    int status;
+    waitpid(producer, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(size() == 0 && visited() == SHARED_ITEMS);
+
+    // Closing wakes this process's blocked consumers, whichever process they were waiting on
+    thrd_t consumer;
+    int result;
+    thrd_create(&consumer, parked_consumer_thread, NULL);
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    closeQueue();
+    thrd_join(consumer, &result);
+    assert(result == 0);
+    destroyQueue();
+
+    printf("shared memory backend test passed.\n");
+}
+
+#define ASYNC_PRODUCERS 4
+#define ASYNC_ITEMS_PER_PRODUCER 10000
+
+struct AsyncChain
+{
+    atomic_int taken;
+    atomic_bool cancelled;
+};
+
+void record_async_item(void *context, void *item)
+{
+    *(void **)context = item;
+}
+
+void chain_async_item(void *context, void *item)
+{
+    // Line up again for the next item from within the continuation, until the queue is closed
+    struct AsyncChain *chain = (struct AsyncChain *)context;
+    if (item == NULL)
+    {
+        atomic_store(&chain->cancelled, true);
+        return;
+    }
+    atomic_fetch_add(&chain->taken, 1);
+    asyncDequeue(chain_async_item, chain);
+}
+
+int async_blocked_consumer_thread(void *arg)
+{
+    *(void **)arg = dequeue();
+    return 0;
+}
+
+int async_producer_thread(void *arg)
+{
+    for (int i = 0; i < ASYNC_ITEMS_PER_PRODUCER; i++)
+    {
+        enqueue(arg);
+    }
+    return 0;
+}
+
+void check_async_dequeue(const struct QueueOptions *options)
+{
+    initQueueWithOptions(options);
+    int items[] = {1, 2, 3};
+    void *first = NULL;
+    void *second = NULL;
+    void *blocked = NULL;
+
+    // An item already queued is passed before asyncDequeue() returns
+    enqueue(&items[0]);
+    asyncDequeue(record_async_item, &first);
+    assert(first == &items[0] && size() == 0);
+
+    // Continuations keep their place among blocked consumers, and the first one runs on the producer's thread
+    first = NULL;
+    asyncDequeue(record_async_item, &first);
+    assert(first == NULL && waiting() == 1);
+    thrd_t consumer;
+    thrd_create(&consumer, async_blocked_consumer_thread, &blocked);
+    while (waiting() < 2)
+    {
+        thrd_yield();
+    }
+    asyncDequeue(record_async_item, &second);
+    assert(waiting() == 3);
+    enqueue(&items[0]);
+    assert(first == &items[0]);
+    enqueue(&items[1]);
+    enqueue(&items[2]);
+    thrd_join(consumer, NULL);
+    assert(blocked == &items[1] && second == &items[2]);
+    assert(waiting() == 0 && size() == 0);
+
+    // Continuations lining up again from within themselves see every item of several producers, and closing the queue runs the last one with NULL
+    struct AsyncChain chain;
+    atomic_init(&chain.taken, 0);
+    atomic_init(&chain.cancelled, false);
+    asyncDequeue(chain_async_item, &chain);
+    thrd_t producers[ASYNC_PRODUCERS];
+    for (int i = 0; i < ASYNC_PRODUCERS; i++)
+    {
+        thrd_create(&producers[i], async_producer_thread, &items[0]);
+    }
+    for (int i = 0; i < ASYNC_PRODUCERS; i++)
+    {
+        thrd_join(producers[i], NULL);
+    }
+    while (atomic_load(&chain.taken) < ASYNC_PRODUCERS * ASYNC_ITEMS_PER_PRODUCER)
+    {
+        thrd_yield();
+    }
+    // The last continuation may still be lining up again on the thread that ran it
+    while (waiting() == 0)
+    {
+        thrd_yield();
+    }
+    assert(!atomic_load(&chain.cancelled));
+    closeQueue();
+    assert(atomic_load(&chain.cancelled) && waiting() == 0);
+
+    // Once closed, continuations run at once
+    first = &items[0];
+    asyncDequeue(record_async_item, &first);
+    assert(first == NULL);
+    destroyQueue();
+}
+
+void test_async_dequeue()
+{
+    printf("=== Testing asyncDequeue ===\n");
+
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST});
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .direct_hand_off = true});
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LIST, .capacity = 4});
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_RING, .capacity = 4});
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_LOCK_FREE_LIST});
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_SHARDED, .lanes = 4});
+    check_async_dequeue(&(struct QueueOptions){.backend = QUEUE_BACKEND_MPSC_LIST});
+
+    printf("asyncDequeue test passed.\n");
+}
+
 int main()
 {
     test_destroyQueue();
@@ -545,6 +2010,28 @@ int main()
     test_enqueue_dequeue_with_sleep();
     test_edge_cases();
     test_mixed_operations();
+    test_reserved_element_pool();
+    test_ring_backend();
+    test_lock_free_list_backend();
+    test_batch_operations();
+    test_multiple_instances();
+    test_dequeue_timed();
+    test_spin_then_park();
+    test_claimed_items();
+    test_direct_hand_off();
+    test_bounded_capacity();
+    test_sharded_backend();
+    test_numa_lane_preference();
+    test_prefetch_next();
+    test_priority();
+    test_stats();
+    test_close_queue();
+    test_single_consumer_backends();
+    test_intrusive();
+    test_notification_descriptor();
+    test_segment_backend();
+    test_shared_memory_backend();
+    test_async_dequeue();
 
     return 0;
 }